@@ -12,6 +12,9 @@ else
 fi
 
 LIBS="$(ncursesw6-config --libs) -lpthread"
+if [[ $(uname -o) != "Darwin" ]]; then
+  LIBS="$LIBS -ldl"
+fi
 OPTS="-std=c++14 -D_X_OPEN_SOURCE_EXTENDED -D__GNU_SOURCE -D_GNU_SOURCE -I modules -Wno-write-strings"
 DBG="-g -DDEBUG -D_DEBUG"
 
@@ -23,4 +26,19 @@ echo "*==============="
 
 g++ $DBG -o my-words-memo $OPTS main.cpp modules/simpleini/ConvertUTF.cpp modules/datetime/datetime.cpp $CURL $LIBS
 g++ $DBG -o my-words-memo-cron $OPTS maincron.cpp modules/datetime/datetime.cpp $CURL
-g++ $DBG -o my-words-memo-tts $OPTS maingtts.cpp
+g++ $DBG -o my-words-memo-tts $OPTS maingtts.cpp $CURL -lpthread
+
+# ./build.sh check - builds and runs the checks
+if [[ "$1" == "check" ]]; then
+  g++ $DBG -o check-http $OPTS -I . checks/http.cpp $CURL -lpthread
+  g++ $DBG -o bench-fold $OPTS checks/fold.cpp
+  g++ $DBG -O1 -fsanitize=thread -o check-events $OPTS checks/events.cpp -lpthread
+  g++ $DBG -o check-cron $OPTS checks/cron.cpp modules/datetime/datetime.cpp -lpthread
+  g++ $DBG -O1 -fsanitize=thread -o check-cron-threads $OPTS checks/cron_threads.cpp modules/datetime/datetime.cpp -lpthread
+  ./check-http
+  ./bench-fold
+  ./check-events
+  ./check-cron
+  TZ=Europe/Paris ./check-cron-threads
+  env -u TZ ./check-cron-threads
+fi
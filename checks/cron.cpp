@@ -0,0 +1,326 @@
+// Check of the cron evaluation of modules/datetime/datetime.cpp against
+// two references that do not go through the cron masks:
+//
+// - a table of expressions with their next and previous fires written by
+//   hand, in UTC and in Europe/Paris over its clock changes;
+// - a matcher reading the fields from the text of the expression, searched
+//   day by day in UTC from times over the next year and close to fires.
+//
+// Then times assign(), next_date() and previous_date() on each expression.
+// Built and run by "./build.sh check". Exits with a failure status if a
+// date differs.
+//
+// A W day of week is friday and saturday, L is saturday. An L day of month
+// is the last day of the month, and the 31st.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "datetime/datetime.h"
+
+#define SAMPLES 24 /* reference times for each expression */
+#define WINDOW (5 * 366) /* days, searched by the matcher */
+#define ROUNDS 2000
+
+using namespace datetime_utils::crontab;
+
+static int failed(0);
+
+// Times are written "YYYY-MM-DD HH:MM:SS +HHMM", none is -1.
+static time_t parse(const char *s) {
+	std::tm tm = {};
+	char sign('+');
+	int off(0);
+	if (!s)
+		return time_t(-1);
+	if (sscanf(s, "%d-%d-%d %d:%d:%d %c%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &sign, &off) != 8) {
+		std::cerr << "bad date " << s << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	tm.tm_year -= 1900, tm.tm_mon--;
+	return timegm(&tm) - (sign == '-' ? -1 : 1) * (off / 100 * 3600 + off % 100 * 60);
+}
+
+static std::string date(time_t t) {
+	char buffer[40] = "none";
+	std::tm tm;
+	if (t != time_t(-1))
+		strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S %z", localtime_r(&t, &tm));
+	return buffer;
+}
+
+// The zone is looked at once a second by the cron evaluation.
+static void use_zone(const char *zone) {
+	setenv("TZ", zone, 1);
+	tzset();
+	std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+}
+
+/// TABLE
+
+static const struct {
+	const char *expr, *from, *next, *previous;
+} table[] = {
+	// from monday 2026-10-19 10:20:30 UTC
+	{ "* * * * * * x", "2026-10-19 10:20:30 +0000", "2026-10-19 10:20:31 +0000", "2026-10-19 10:20:30 +0000" },
+	{ "0 0 0 * * * x", "2026-10-19 10:20:30 +0000", "2026-10-20 00:00:00 +0000", "2026-10-19 00:00:00 +0000" },
+	{ "30 15 9 * * * x", "2026-10-19 10:20:30 +0000", "2026-10-20 09:15:30 +0000", "2026-10-19 09:15:30 +0000" },
+	{ "* * * 5 * * x", "2026-10-19 10:20:30 +0000", "2026-11-05 00:00:00 +0000", "2026-10-05 23:59:59 +0000" },
+	{ "* * * * JUL * x", "2026-10-19 10:20:30 +0000", "2027-07-01 00:00:00 +0000", "2026-07-31 23:59:59 +0000" },
+	{ "*/10 * 7 * * * x", "2026-10-19 10:20:30 +0000", "2026-10-20 07:00:00 +0000", "2026-10-19 07:59:50 +0000" },
+	{ "*/7 3 * * * * x", "2026-10-19 10:20:30 +0000", "2026-10-19 11:03:00 +0000", "2026-10-19 10:03:56 +0000" },
+	{ "0 */15 9-17 * * MON-FRI x", "2026-10-19 10:20:30 +0000", "2026-10-19 10:30:00 +0000", "2026-10-19 10:15:00 +0000" },
+	{ "* */15 9-17 * * mon,tue,thu,fri x", "2026-10-19 10:20:30 +0000", "2026-10-19 10:30:00 +0000", "2026-10-19 10:15:59 +0000" },
+	{ "0 0 12 ? * SUN x", "2026-10-19 10:20:30 +0000", "2026-10-25 12:00:00 +0000", "2026-10-18 12:00:00 +0000" },
+	{ "0 0 12 13 * FRI x", "2026-10-19 10:20:30 +0000", "2026-11-13 12:00:00 +0000", "2026-03-13 12:00:00 +0000" },
+	{ "5,10 * * 13 * FRI x", "2026-10-19 10:20:30 +0000", "2026-11-13 00:00:05 +0000", "2026-03-13 23:59:10 +0000" },
+	{ "0 0 0 31 * * x", "2026-10-19 10:20:30 +0000", "2026-10-31 00:00:00 +0000", "2026-08-31 00:00:00 +0000" },
+	{ "0 0 0 L * * x", "2026-10-19 10:20:30 +0000", "2026-10-31 00:00:00 +0000", "2026-09-30 00:00:00 +0000" },
+	{ "0 0 0 L FEB * x", "2026-10-19 10:20:30 +0000", "2027-02-28 00:00:00 +0000", "2026-02-28 00:00:00 +0000" },
+	{ "0 0 0 29 FEB * x", "2026-10-19 10:20:30 +0000", "2028-02-29 00:00:00 +0000", "2024-02-29 00:00:00 +0000" },
+	{ "0 0 9 * * W x", "2026-10-19 10:20:30 +0000", "2026-10-23 09:00:00 +0000", "2026-10-17 09:00:00 +0000" },
+	{ "0 0 9 * * L x", "2026-10-19 10:20:30 +0000", "2026-10-24 09:00:00 +0000", "2026-10-17 09:00:00 +0000" },
+	{ "0 0 0 L * W x", "2026-10-19 10:20:30 +0000", "2026-10-31 00:00:00 +0000", "2026-07-31 00:00:00 +0000" },
+	{ "0 0 8 1,15 jan,jul * x", "2026-10-19 10:20:30 +0000", "2027-01-01 08:00:00 +0000", "2026-07-15 08:00:00 +0000" },
+	{ "0 15 10 1,15 JAN-JUN * x", "2026-10-19 10:20:30 +0000", "2027-01-01 10:15:00 +0000", "2026-06-15 10:15:00 +0000" },
+	{ "0 0 0 */2 * * x", "2026-10-19 10:20:30 +0000", "2026-10-21 00:00:00 +0000", "2026-10-19 00:00:00 +0000" },
+	{ "0 0 0 1 */3 * x", "2026-10-19 10:20:30 +0000", "2027-01-01 00:00:00 +0000", "2026-10-01 00:00:00 +0000" },
+	{ "0 0 0 1 2/5 * x", "2026-10-19 10:20:30 +0000", "2026-12-01 00:00:00 +0000", "2026-07-01 00:00:00 +0000" },
+	{ "0 0 0 * * */2 x", "2026-10-19 10:20:30 +0000", "2026-10-20 00:00:00 +0000", "2026-10-18 00:00:00 +0000" },
+	{ "0 45 23 * DEC SAT x", "2026-10-19 10:20:30 +0000", "2026-12-05 23:45:00 +0000", "2025-12-27 23:45:00 +0000" },
+	{ "0 0 6 * * * 2027 x", "2026-10-19 10:20:30 +0000", "2027-01-01 06:00:00 +0000", nullptr },
+	{ "0 0 0 1 1 * 2027,2029 x", "2028-06-01 00:00:00 +0000", "2029-01-01 00:00:00 +0000", "2027-01-01 00:00:00 +0000" },
+	{ "0 0 0 1 1 * 2025-2027 x", "2026-10-19 10:20:30 +0000", "2027-01-01 00:00:00 +0000", "2026-01-01 00:00:00 +0000" },
+	// Europe/Paris, clocks forward on 2026-03-29 at 02:00 and back on
+	// 2026-10-25 at 03:00: a skipped time fires at the change, a repeated
+	// one the first time, unless the job runs every hour
+	{ "0 30 2 * * * x", "2026-03-28 12:00:00 +0100", "2026-03-29 03:00:00 +0200", "2026-03-28 02:30:00 +0100" },
+	{ "0 30 2 * * * x", "2026-03-29 12:00:00 +0200", "2026-03-30 02:30:00 +0200", "2026-03-29 03:00:00 +0200" },
+	{ "0 30 2 * * * x", "2026-10-25 12:00:00 +0100", "2026-10-26 02:30:00 +0100", "2026-10-25 02:30:00 +0200" },
+	{ "0 30 2 * * * x", "2026-10-25 02:45:00 +0200", "2026-10-26 02:30:00 +0100", "2026-10-25 02:30:00 +0200" },
+	{ "0 0 * * * * x", "2026-10-25 02:10:00 +0200", "2026-10-25 02:00:00 +0100", "2026-10-25 02:00:00 +0200" },
+	{ "0 0 * * * * x", "2026-03-29 01:30:00 +0100", "2026-03-29 03:00:00 +0200", "2026-03-29 01:00:00 +0100" },
+};
+
+// The dates of the table are within the years a cron holds around the
+// current one from 2021 to 2032.
+static void check_table(const char *zone, bool paris) {
+	const time_t now(time(NULL));
+	std::tm tm;
+	if (gmtime_r(&now, &tm)->tm_year + 1900 - SCOPE_OF_YEARS > 2024 || tm.tm_year + 1900 + SCOPE_OF_YEARS < 2029) {
+		std::cout << "  skipped, the dates are out of the years of a cron" << std::endl;
+		return;
+	}
+	use_zone(zone);
+	for (const auto &row : table) {
+		if ((strstr(row.from, "+0000") == nullptr) != paris)
+			continue;
+		const cron c{ std::string(row.expr) };
+		const time_t from(parse(row.from)), next(c.next_date(from)), previous(c.previous_date(from));
+		const bool ok(!c.error() && next == parse(row.next) && previous == parse(row.previous));
+		std::cout << (ok ? "  ok   " : "  FAIL ") << row.expr << " from " << row.from;
+		if (c.error())
+			std::cout << " - invalid";
+		else if (!ok)
+			std::cout << " - next " << date(next) << ", previous " << date(previous);
+		std::cout << std::endl;
+		failed += !ok;
+	}
+}
+
+/// MATCHER
+
+// Fields read from the text of the expression, value by value.
+struct matcher_t {
+	static const int low[7], high[7];
+	std::vector<bool> allowed[7]; // indexed by the value of the field
+	bool last = false, any_year = false;
+
+	matcher_t(const std::string &expr) {
+		std::istringstream in(expr);
+		std::vector<std::string> words;
+		for (std::string w; in >> w;)
+			words.push_back(w);
+		const int fields(words.size() > 7 ? 7 : 6); // the last word is the command
+		for (int f(0); f < 7; f++)
+			allowed[f].assign(high[f] + 1, false);
+		for (int f(0); f < fields; f++) {
+			std::istringstream items(words[f]);
+			for (std::string item; std::getline(items, item, ',');)
+				add(f, item);
+		}
+		any_year = fields == 6;
+	}
+
+	static int value(int f, const std::string &s) {
+		static const char *names[] = { "SUN", "MON", "TUE", "WED", "THU", "FRI", "SAT", "JAN", "FEB", "MAR", "APR", "MAY", "JUN", "JUL", "AUG", "SEP", "OCT", "NOV", "DEC" };
+		std::string u(s);
+		for (char &c : u)
+			c = toupper(c);
+		for (int i(0); i < 19; i++)
+			if (u == names[i] && (f == 5 ? i < 7 : f == 4 && i >= 7))
+				return f == 5 ? i : i - 6;
+		return atoi(s.c_str());
+	}
+
+	void add(int f, const std::string &item) {
+		const size_t dash(item.find('-')), slash(item.find('/'));
+		if (item == "*" || item == "?")
+			for (int v(low[f]); v <= high[f]; v++)
+				allowed[f][v] = true;
+		else if (item == "L" && f == 3)
+			last = true, allowed[f][31] = true;
+		else if (item == "L")
+			allowed[f][6] = true;
+		else if (item == "W")
+			allowed[f][5] = allowed[f][6] = true;
+		else if (dash != std::string::npos)
+			for (int v(value(f, item.substr(0, dash))), b(value(f, item.substr(dash + 1))); v <= b; v++)
+				allowed[f][v] = true;
+		else if (slash != std::string::npos)
+			for (int v(item[0] == '*' ? low[f] : value(f, item.substr(0, slash))), step(atoi(item.c_str() + slash + 1)); v <= high[f]; v += step)
+				allowed[f][v] = true;
+		else
+			allowed[f][value(f, item)] = true;
+	}
+
+	bool day(const std::tm &t) const {
+		std::tm next_day(t);
+		next_day.tm_mday++;
+		timegm(&next_day);
+		const int y(1900 + t.tm_year);
+		return (allowed[3][t.tm_mday] || (last && next_day.tm_mday == 1)) && allowed[4][t.tm_mon + 1] && allowed[5][t.tm_wday] &&
+			   (any_year || (y <= high[6] && allowed[6][y]));
+	}
+
+	// First second of the day from midnight firing from the second from
+	// on (or the last one up to it), -1 if none.
+	time_t in_day(time_t midnight, int from, bool next) const {
+		for (int s(from); next ? s < 86400 : s >= 0; s += next ? 1 : -1)
+			if (allowed[2][s / 3600] && allowed[1][s / 60 % 60] && allowed[0][s % 60])
+				return midnight + s;
+		return time_t(-1);
+	}
+
+	time_t search(time_t t, bool next) const {
+		time_t midnight(t - t % 86400);
+		int from(next ? t % 86400 + 1 : t % 86400);
+		for (int d(0); d < WINDOW; d++, midnight += next ? 86400 : -86400, from = next ? 0 : 86399) {
+			std::tm tm;
+			if (day(*gmtime_r(&midnight, &tm))) {
+				const time_t found(in_day(midnight, from, next));
+				if (found != time_t(-1))
+					return found;
+			}
+		}
+		return time_t(-1);
+	}
+};
+
+const int matcher_t::low[] = { 0, 0, 0, 1, 1, 0, 1970 };
+const int matcher_t::high[] = { 59, 59, 23, 31, 12, 6, 2100 };
+
+static const char *corpus[] = {
+	"* * * * * * x",
+	"0 0 0 * * * x",
+	"0 30 2 * * * x",
+	"* * * 5 * * x",
+	"* * * * JUL * x",
+	"*/10 * 7 * * * x",
+	"*/7 3 * * * * x",
+	"0 */5 * * * * x",
+	"0 */15 9-17 * * MON-FRI x",
+	"* */20 10-18 * * sat x",
+	"0 0 12 ? * SUN x",
+	"5,10 * * 13 * FRI x",
+	"0 0 0 1 * MON x",
+	"0 0 0 31 * * x",
+	"0 0 0 L * * x",
+	"0 0 0 L FEB * x",
+	"0 0 0 29 FEB * x",
+	"0 0 9 * * W x",
+	"0 0 9 * * L x",
+	"0 0 0 L * W x",
+	"0 15 10 1,15 JAN-JUN * x",
+	"15 10 * * jan,jul * x",
+	"0 0 0 */2 * * x",
+	"0 0 0 3/10 * * x",
+	"0 0 0 1 */3 * x",
+	"0 0 0 * * */2 x",
+	"0 45 23 * DEC SAT x",
+	"0 0 6 * * * 2027 x",
+	"0 0 0 1 1 * 2026-2030 x",
+};
+
+// The dates found are compared with the matcher from times over the next
+// year, and from times shortly before (or after) a fire so that rare
+// schedules are covered.
+static void check_matcher(void) {
+	use_zone("UTC");
+	const time_t now(time(NULL));
+	for (const char *expr : corpus) {
+		const cron c{ std::string(expr) };
+		const matcher_t m(expr);
+		unsigned seed(std::hash<std::string>()(expr));
+		int bad(0);
+		for (int k(0); k < SAMPLES && !c.error(); k++)
+			for (int next(0); next < 2; next++) {
+				time_t t(now + long(rand_r(&seed) % (366 * 86400L)));
+				if (k & 1) { // close to a fire
+					const time_t f(m.search(t, next));
+					if (f != time_t(-1))
+						t = next ? f - 1 - rand_r(&seed) % 7200 : f + rand_r(&seed) % 7200;
+				}
+				const time_t got(next ? c.next_date(t) : c.previous_date(t)), want(m.search(t, next));
+				if (got != want && bad++ < 3)
+					std::cout << "  MISMATCH " << expr << ": " << (next ? "next" : "previous") << " of " << date(t) << " is " << date(got) << ", matcher found " << date(want) << std::endl;
+			}
+		const bool ok(!c.error() && !bad);
+		std::cout << (ok ? "  ok   " : "  FAIL ") << expr << (c.error() ? " - invalid" : "") << std::endl;
+		failed += !ok;
+	}
+}
+
+/// TIMINGS
+
+static void bench(void) {
+	const time_t now(time(NULL));
+	for (const char *expr : corpus) {
+		cron c{ std::string(expr) };
+		const auto t0(std::chrono::steady_clock::now());
+		for (int i(0); i < ROUNDS; i++)
+			c.clear() = std::string(expr);
+		const auto t1(std::chrono::steady_clock::now());
+		time_t t(now);
+		volatile time_t sink(0); // keeps the loops
+		for (int i(0); i < ROUNDS; i++, t += 3607)
+			sink += c.next_date(t);
+		const auto t2(std::chrono::steady_clock::now());
+		for (int i(0); i < ROUNDS; i++, t += 3607)
+			sink += c.previous_date(t);
+		const auto t3(std::chrono::steady_clock::now());
+		auto ns = [](std::chrono::steady_clock::duration d) { return long(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / ROUNDS); };
+		std::cout << "  " << expr << " - assign " << ns(t1 - t0) << " ns, next " << ns(t2 - t1) << " ns, previous " << ns(t3 - t2) << " ns" << std::endl;
+	}
+}
+
+int main(int argc, char **argv) {
+	std::cout << "Table:" << std::endl;
+	check_table("UTC", false);
+	check_table("Europe/Paris", true);
+	std::cout << "Matcher:" << std::endl;
+	check_matcher();
+	std::cout << "Timings:" << std::endl;
+	bench();
+	std::cout << failed << " failed." << std::endl;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
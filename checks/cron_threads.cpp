@@ -0,0 +1,104 @@
+// Check of cron evaluation from several threads at once. The crons are
+// parsed once into a const vector, then every thread evaluates
+// next_date() and previous_date() on all of them, and each date is
+// compared with the one found beforehand on a single thread.
+//
+// Built with -fsanitize=thread and run by "./build.sh check", with the
+// zone of TZ and with TZ unset. Exits with a failure status if a date
+// differs; ThreadSanitizer reports races on its own.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "datetime/datetime.h"
+
+#define THREADS 8
+#define TIMES 400 /* reference times */
+
+using namespace datetime_utils::crontab;
+
+static const char *corpus[] = {
+	"* */15 9-17 * * mon,tue,thu,fri check",
+	"* */20 10-18 * * sat check",
+	"* */30 12-18 * * sun check",
+	"0 0 0 * * * check",
+	"0 30 2 * * * check",
+	"0 0 3 * * sun check",
+	"*/10 * * * * * check",
+	"0 0 12 1 * * check",
+	"0 0 0 29 2 * check",
+	"0 0 0 31 * * check",
+	"0 0 0 * * 1-5 check",
+	"0 0 8 1,15 jan,jul * check",
+};
+
+// Random times over the next 400 days, the seconds around the clock
+// changes of the local zone, and times some years ahead.
+static std::vector<time_t> sample_times(void) {
+	std::vector<time_t> changes;
+	const time_t now(time(NULL));
+	std::tm a, b;
+	localtime_r(&now, &a);
+	for (time_t t(now); t < now + 400 * 86400L; t += 3600) {
+		localtime_r(&t, &b);
+		if (b.tm_gmtoff != a.tm_gmtoff)
+			changes.push_back(t - t % 3600);
+		a = b;
+	}
+
+	std::vector<time_t> times;
+	unsigned seed(TIMES);
+	for (int k(0); times.size() < TIMES; k++) {
+		time_t t(now + long(rand_r(&seed) % (400 * 86400L)));
+		if ((k & 3) == 1 && !changes.empty()) // right around a clock change
+			t = changes[k % changes.size()] - 1 + k % 3;
+		else if ((k & 7) == 2) // some years ahead
+			t = now + 5 * 366 * 86400L + long(rand_r(&seed) % (2 * 366 * 86400L));
+		times.push_back(t);
+	}
+	return times;
+}
+
+int main(int argc, char **argv) {
+	std::vector<cron> parsed;
+	for (const char *expr : corpus)
+		parsed.emplace_back(std::string(expr));
+	const std::vector<cron> crons(std::move(parsed));
+	const std::vector<time_t> times(sample_times());
+
+	std::vector<time_t> want;
+	for (const cron &c : crons)
+		for (time_t t : times)
+			want.push_back(c.next_date(t)), want.push_back(c.previous_date(t));
+
+	std::atomic<long> mismatches(0);
+	const auto t0(std::chrono::steady_clock::now());
+	std::vector<std::thread> pool;
+	for (int n(0); n < THREADS; n++)
+		pool.emplace_back([&, n] {
+			for (size_t i(0); i < crons.size(); i++) {
+				const size_t k((i + n) % crons.size()); // not all on the same cron
+				for (size_t j(0); j < times.size(); j++) {
+					const size_t w(2 * (k * times.size() + j));
+					mismatches += (crons[k].next_date(times[j]) != want[w]) + (crons[k].previous_date(times[j]) != want[w + 1]);
+				}
+			}
+		});
+	for (std::thread &t : pool)
+		t.join();
+	const long evaluations(long(THREADS) * want.size());
+	const long ns(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count() / evaluations);
+
+	const char *zone(getenv("TZ"));
+	std::cout << (mismatches ? "  FAIL " : "  ok   ") << crons.size() << " crons from " << THREADS << " threads, TZ " << (zone ? zone : "unset") << " - "
+			  << evaluations << " evaluations, " << mismatches << " differ, " << ns << " ns each" << std::endl;
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+// Check of the event ring of modules/events/events.h: the order and count
+// of the events a consumer gets while a faster producer keeps dropping
+// the oldest ones, the same with several producers at once, and a push
+// into a full ring while the consumer is stalled between claiming the
+// oldest slot and releasing it.
+//
+// Built with -fsanitize=thread and run by "./build.sh check". Exits with
+// a failure status if a check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "events/events.h"
+
+#define EVENTS 200000 /* pushed by the stress checks */
+#define PRODUCERS 4
+
+static int failed(0);
+
+static void report(bool ok, const std::string &name, const std::string &detail) {
+	std::cout << (ok ? "  ok   " : "  FAIL ") << name << " - " << detail << std::endl;
+	failed += !ok;
+}
+
+// An event whose move into the consumer stops halfway when armed: the
+// consumer has claimed the slot and not released it yet.
+struct stalling_t {
+	int n = -1;
+	static std::atomic<bool> armed, stalled, resume;
+
+	stalling_t() = default;
+	stalling_t(int n) :
+			n(n) {}
+	stalling_t(stalling_t &&o) :
+			n(o.n) {}
+	stalling_t &operator=(stalling_t &&o) {
+		n = o.n;
+		if (armed.exchange(false)) {
+			stalled = true;
+			while (!resume)
+				std::this_thread::yield();
+		}
+		return *this;
+	}
+};
+std::atomic<bool> stalling_t::armed(false), stalling_t::stalled(false), stalling_t::resume(false);
+
+// A push into a full ring must wait for the stalled consumer to release
+// the oldest slot, and then take it without dropping anything.
+static void check_stalled_consumer(void) {
+	static event_ring<stalling_t, 4> ring;
+	for (int i(0); i < 4; i++)
+		ring.push(stalling_t(i));
+
+	stalling_t first;
+	stalling_t::armed = true;
+	std::thread consumer([&] { ring.pop(first); });
+	while (!stalling_t::stalled)
+		std::this_thread::yield();
+
+	std::atomic<bool> pushed(false), kept(false);
+	std::thread producer([&] {
+		kept = ring.push(stalling_t(4));
+		pushed = true;
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	const bool waited(!pushed), none_dropped(ring.drops() == 0);
+	stalling_t::resume = true;
+	consumer.join(), producer.join();
+
+	std::vector<int> got(1, first.n);
+	for (stalling_t e; ring.pop(e);)
+		got.push_back(e.n);
+	std::string seq;
+	for (int n : got)
+		seq += (seq.empty() ? "" : " ") + std::to_string(n);
+	report(waited && none_dropped, "stalled consumer", std::string(waited ? "push waited" : "push did not wait") + ", " + std::to_string(ring.drops()) + " dropped while stalled");
+	report(kept && got == std::vector<int>({ 0, 1, 2, 3, 4 }), "stalled consumer", "events " + seq);
+}
+
+// The consumer gets increasing events, and all of them but the drops.
+static void check_drops(void) {
+	static event_ring<int, 16> ring;
+	std::atomic<bool> done(false);
+	long received(0), out_of_order(0);
+	std::thread consumer([&] {
+		int last(-1);
+		for (;;) {
+			const bool finished(done);
+			int v;
+			if (ring.pop(v)) {
+				out_of_order += v <= last;
+				last = v, received++;
+			} else if (finished)
+				break;
+			else
+				ring.wait(1);
+		}
+	});
+	for (int i(0); i < EVENTS; i++)
+		ring.push(i);
+	done = true, ring.wake();
+	consumer.join();
+	report(!out_of_order && received + long(ring.drops()) == EVENTS, "drop oldest",
+		   std::to_string(received) + " received, " + std::to_string(ring.drops()) + " dropped, " + std::to_string(out_of_order) + " out of order");
+}
+
+// With several producers, the consumer gets the events of each producer
+// in increasing order, and all of them but the drops.
+static void check_producers(void) {
+	static event_ring<int, 16> ring;
+	std::atomic<bool> done(false);
+	long received(0), out_of_order(0);
+	std::thread consumer([&] {
+		std::vector<int> last(PRODUCERS, -1);
+		for (;;) {
+			const bool finished(done);
+			int v;
+			if (ring.pop(v)) {
+				int &l(last[v % PRODUCERS]);
+				out_of_order += v <= l;
+				l = v, received++;
+			} else if (finished)
+				break;
+			else
+				ring.wait(1);
+		}
+	});
+	std::vector<std::thread> producers;
+	for (int p(0); p < PRODUCERS; p++)
+		producers.emplace_back([p] {
+			for (int i(p); i < EVENTS; i += PRODUCERS)
+				ring.push(i);
+		});
+	for (std::thread &t : producers)
+		t.join();
+	done = true, ring.wake();
+	consumer.join();
+	report(!out_of_order && received + long(ring.drops()) == EVENTS, "producers",
+		   std::to_string(PRODUCERS) + " producers, " + std::to_string(received) + " received, " + std::to_string(ring.drops()) + " dropped, " +
+			   std::to_string(out_of_order) + " out of order");
+}
+
+int main(int argc, char **argv) {
+	std::cout << "Event ring:" << std::endl;
+	check_stalled_consumer();
+	check_drops();
+	check_producers();
+	std::cout << failed << " failed." << std::endl;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
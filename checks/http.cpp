@@ -0,0 +1,343 @@
+// Checks the download paths of par_easycurl against an in-process
+// loopback HTTP server: a words file with an ETag, fake MP3 bodies, slow
+// responses, truncated bodies, 5xx errors and a refused connection. The
+// results, the files left behind and the descriptors left open are
+// checked, then the throughput and latency of large bodies are measured
+// so changes of the download path can be compared offline.
+//
+// Built and run by "./build.sh check". Exits with a failure status if a
+// check fails.
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "par_easycurl.h"
+
+#define WORDS_ETAG "\"words-1\""
+#define SLOW_DELAY 300 /* ms, before the headers and spread over the body */
+#define TRUNCATED_SIZE 65536
+#define BIG_SIZE (4 << 20)
+#define ROUNDS 20
+
+static const std::string words_body =
+		"[a]\n"
+		"1 = gato :: cat\n"
+		"2 = año :: year\n"
+		"3 = pingüino :: penguin\n";
+
+// Fake MP3 body: an ID3 tag, then frame headers and filler.
+static std::string mp3_body(size_t size) {
+	std::string body("ID3\x03\x00\x00\x00\x00\x00\x00", 10);
+	while (body.size() < size)
+		body += std::string("\xff\xfb\x90\x64", 4) + std::string(413, char(body.size() & 0x7f));
+	body.resize(size);
+	return body;
+}
+
+static const std::string sample_body = mp3_body(8192), big_body = mp3_body(BIG_SIZE);
+
+/// LOOPBACK SERVER
+
+// Serves the routes on 127.0.0.1, a thread per connection. Connection: close
+// on every response, as par_easycurl does not reuse its handles.
+class loopback_server {
+	int _fd = -1, _port = 0;
+	std::thread _accept;
+	std::vector<std::thread> _conns;
+	std::mutex _m;
+	std::atomic<bool> _stop{ false };
+	std::atomic<int> _active{ 0 }, _served{ 0 };
+
+	static bool send_all(int fd, const char *data, size_t n) {
+		while (n > 0) {
+			const ssize_t w(send(fd, data, n, MSG_NOSIGNAL));
+			if (w <= 0)
+				return false;
+			data += w, n -= w;
+		}
+		return true;
+	}
+
+	static std::string head(int status, const char *reason, size_t length, const std::string &extra = "") {
+		std::ostringstream s;
+		s << "HTTP/1.1 " << status << " " << reason << "\r\nContent-Length: " << length << "\r\n"
+		  << extra << "Connection: close\r\n\r\n";
+		return s.str();
+	}
+
+	void serve(int fd) {
+		std::string req;
+		char buf[4096];
+		ssize_t n;
+		while (req.find("\r\n\r\n") == std::string::npos && (n = recv(fd, buf, sizeof(buf), 0)) > 0)
+			req.append(buf, n);
+		const size_t sp(req.find(' '));
+		const std::string path(sp == std::string::npos ? "" : req.substr(sp + 1, req.find(' ', sp + 1) - sp - 1));
+		const bool etag_match(req.find("If-None-Match: " WORDS_ETAG "\r\n") != std::string::npos);
+
+		std::string out;
+		if (path == "/words.ini") {
+			if (etag_match)
+				out = head(304, "Not Modified", 0, "ETag: " WORDS_ETAG "\r\n");
+			else
+				out = head(200, "OK", words_body.size(), "ETag: " WORDS_ETAG "\r\n") + words_body;
+		} else if (path == "/sample.mp3") {
+			out = head(200, "OK", sample_body.size(), "Content-Type: audio/mpeg\r\n") + sample_body;
+		} else if (path == "/big.mp3") {
+			out = head(200, "OK", big_body.size(), "Content-Type: audio/mpeg\r\n") + big_body;
+		} else if (path == "/slow.mp3") {
+			std::this_thread::sleep_for(std::chrono::milliseconds(SLOW_DELAY));
+			const std::string h(head(200, "OK", sample_body.size(), "Content-Type: audio/mpeg\r\n"));
+			if (send_all(fd, h.data(), h.size()))
+				for (size_t at(0), piece(sample_body.size() / 4); at < sample_body.size(); at += piece) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(SLOW_DELAY / 4));
+					if (!send_all(fd, sample_body.data() + at, std::min(piece, sample_body.size() - at)))
+						break;
+				}
+		} else if (path == "/truncated.mp3") { // announces more than it sends
+			const std::string body(mp3_body(TRUNCATED_SIZE));
+			out = head(200, "OK", body.size(), "Content-Type: audio/mpeg\r\n") + body.substr(0, body.size() / 4);
+		} else if (path == "/500") {
+			out = head(500, "Internal Server Error", 5) + "oops\n";
+		} else if (path == "/503") {
+			out = head(503, "Service Unavailable", 5, "Retry-After: 1\r\n") + "busy\n";
+		} else {
+			out = head(404, "Not Found", 0);
+		}
+		if (!out.empty())
+			send_all(fd, out.data(), out.size());
+		shutdown(fd, SHUT_WR);
+		while (recv(fd, buf, sizeof(buf), 0) > 0) // until the client closes
+			;
+		close(fd);
+		_served++;
+		_active--;
+	}
+
+public:
+	bool start(void) {
+		struct sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len(sizeof(addr));
+		if ((_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 || bind(_fd, (struct sockaddr *)&addr, len) != 0 ||
+				listen(_fd, 16) != 0 || getsockname(_fd, (struct sockaddr *)&addr, &len) != 0)
+			return false;
+		_port = ntohs(addr.sin_port);
+		_accept = std::thread([this] {
+			struct pollfd pfd = { _fd, POLLIN, 0 };
+			while (!_stop)
+				if (poll(&pfd, 1, 100) > 0) {
+					const int c(accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC));
+					if (c < 0)
+						continue;
+					_active++;
+					std::lock_guard<std::mutex> l(_m);
+					_conns.emplace_back(&loopback_server::serve, this, c);
+				}
+		});
+		return true;
+	}
+
+	// Waits for the connections served to be closed.
+	void settle(void) {
+		while (_active)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	void stop(void) {
+		_stop = true;
+		if (_accept.joinable())
+			_accept.join();
+		for (std::thread &t : _conns)
+			t.join();
+		if (_fd >= 0)
+			close(_fd);
+	}
+
+	std::string url(const std::string &path) const { return "http://127.0.0.1:" + std::to_string(_port) + path; }
+	int served(void) const { return _served; }
+};
+
+/// CHECKS
+
+static std::string dir;
+static FILE *quiet; // log stream of the _ex variants
+static int failed(0);
+
+static bool exists(const std::string &path) {
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+static std::string contents(const std::string &path) {
+	std::ifstream in(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static long file_size(const std::string &path) {
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 ? long(st.st_size) : -1;
+}
+
+static int open_fds(void) {
+	int n(0);
+	if (DIR *d = opendir("/proc/self/fd")) {
+		while (readdir(d))
+			n++;
+		closedir(d);
+	}
+	return n;
+}
+
+static void report(bool ok, const std::string &name, const std::string &detail = "") {
+	const par_easycurl_stats st(par_easycurl_last_stats());
+	std::cout << (ok ? "  ok   " : "  FAIL ") << name << " - HTTP " << st.status << ", " << st.bytes << " bytes, first byte "
+			  << long(st.first_byte_time * 1000) << " ms, total " << long(st.total_time * 1000) << " ms" << (detail.empty() ? "" : ", ") << detail << std::endl;
+	failed += !ok;
+}
+
+// A download to file: the result, the status and what is left on disk.
+static void check_file(const std::string &name, const std::string &url, const char **hdrs, bool ex, int want, long status, const std::string *body) {
+	const std::string path(dir + "/" + name);
+	const int got(ex ? par_easycurl_to_file_ex(url.c_str(), path.c_str(), hdrs, quiet) : par_easycurl_to_file(url.c_str(), path.c_str()));
+	const bool left(exists(path));
+	bool ok(got == want && par_easycurl_last_stats().status == status && left == bool(want));
+	if (ok && body)
+		ok = contents(path) == *body;
+	report(ok, std::string(ex ? "to_file_ex   " : "to_file      ") + name, left ? "file kept" : "no file");
+	remove(path.c_str());
+}
+
+static void check_memory(const std::string &name, const std::string &url, const char **hdrs, int want, long status, const std::string *body) {
+	par_byte *data(nullptr);
+	int nbytes(0);
+	const int got(hdrs ? par_easycurl_to_memory_ex(url.c_str(), &data, &nbytes, hdrs, quiet) : par_easycurl_to_memory(url.c_str(), &data, &nbytes));
+	bool ok(got == want && par_easycurl_last_stats().status == status && bool(data) == bool(want));
+	if (ok && body)
+		ok = std::string((const char *)data, nbytes) == *body;
+	report(ok, std::string(hdrs ? "to_memory_ex " : "to_memory    ") + name);
+	free(data);
+}
+
+// Median, best and worst of the rounds, and the throughput at the median.
+static void measure(const std::string &name, std::function<bool()> download) {
+	std::vector<double> ms;
+	int errors(0);
+	for (int i(0); i < ROUNDS; i++) {
+		const auto t0(std::chrono::steady_clock::now());
+		errors += !download();
+		ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+	}
+	std::sort(ms.begin(), ms.end());
+	const double median(ms[ms.size() / 2]);
+	std::cout << "  " << name << " " << (BIG_SIZE >> 20) << " MB x " << ROUNDS << ": median " << median << " ms (best " << ms.front() << ", worst " << ms.back()
+			  << "), " << long(BIG_SIZE / 1048576.0 / (median / 1000)) << " MB/s, first byte " << long(par_easycurl_last_stats().first_byte_time * 1e6) << " us"
+			  << (errors ? ", ERRORS" : "") << std::endl;
+	failed += errors != 0;
+}
+
+/// MAIN
+
+int main(int argc, char **argv) {
+	char tmpl[] = "/tmp/words-memo-http.XXXXXX";
+	if (!mkdtemp(tmpl)) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	dir = tmpl;
+	quiet = fopen("/dev/null", "w");
+
+	loopback_server server;
+	if (!server.start()) {
+		perror("loopback server");
+		return EXIT_FAILURE;
+	}
+	par_easycurl_init(0);
+
+	// a port nothing listens on
+	std::string refused;
+	{
+		loopback_server closed;
+		closed.start();
+		refused = closed.url("/words.ini");
+		closed.stop();
+	}
+
+	const char *etag_match[] = { "If-None-Match: " WORDS_ETAG, nullptr };
+	const char *etag_other[] = { "If-None-Match: \"words-0\"", nullptr };
+
+	par_byte *warm(nullptr);
+	int warm_n(0);
+	par_easycurl_to_memory(server.url("/sample.mp3").c_str(), &warm, &warm_n); // libraries loaded, first descriptors opened
+	free(warm);
+	server.settle();
+	const int fds(open_fds());
+
+	std::cout << "Download paths:" << std::endl;
+	check_file("words.ini", server.url("/words.ini"), nullptr, false, 1, 200, &words_body);
+	check_file("words.ini", server.url("/words.ini"), etag_other, true, 1, 200, &words_body);
+	check_file("words.ini", server.url("/words.ini"), etag_match, true, 0, 304, nullptr);
+	check_file("sample.mp3", server.url("/sample.mp3"), nullptr, false, 1, 200, &sample_body);
+	check_file("slow.mp3", server.url("/slow.mp3"), nullptr, true, 1, 200, &sample_body);
+	report(par_easycurl_last_stats().first_byte_time >= SLOW_DELAY / 1000.0 * 0.9, "stats        slow.mp3", "first byte after the delay");
+	check_file("truncated.mp3", server.url("/truncated.mp3"), nullptr, false, 0, 200, nullptr);
+	check_file("truncated.mp3", server.url("/truncated.mp3"), nullptr, true, 0, 200, nullptr);
+	check_file("500", server.url("/500"), nullptr, false, 0, 500, nullptr);
+	check_file("503", server.url("/503"), nullptr, true, 0, 503, nullptr);
+	check_file("404", server.url("/404"), nullptr, false, 0, 404, nullptr);
+	check_file("refused", refused, nullptr, false, 0, 0, nullptr);
+	check_file("refused", refused, nullptr, true, 0, 0, nullptr);
+	check_memory("words.ini", server.url("/words.ini"), nullptr, 1, 200, &words_body);
+	check_memory("words.ini", server.url("/words.ini"), etag_match, 0, 304, nullptr);
+	check_memory("sample.mp3", server.url("/sample.mp3"), nullptr, 1, 200, &sample_body);
+	check_memory("slow.mp3", server.url("/slow.mp3"), nullptr, 1, 200, &sample_body);
+	check_memory("truncated.mp3", server.url("/truncated.mp3"), nullptr, 0, 200, nullptr);
+	check_memory("500", server.url("/500"), nullptr, 0, 500, nullptr);
+	check_memory("503", server.url("/503"), etag_other, 0, 503, nullptr);
+	check_memory("refused", refused, nullptr, 0, 0, nullptr);
+
+	server.settle();
+	const int leaked(open_fds() - fds);
+	std::cout << (leaked ? "  FAIL " : "  ok   ") << "descriptors - " << leaked << " left open after " << server.served() << " requests" << std::endl;
+	failed += leaked != 0;
+
+	std::cout << "Throughput:" << std::endl;
+	const std::string big(server.url("/big.mp3")), path(dir + "/big.mp3");
+	measure("to_memory ", [&] {
+		par_byte *data(nullptr);
+		int nbytes(0);
+		const bool ok(par_easycurl_to_memory(big.c_str(), &data, &nbytes) && nbytes == BIG_SIZE);
+		free(data);
+		return ok;
+	});
+	measure("to_file   ", [&] { return par_easycurl_to_file(big.c_str(), path.c_str()) && file_size(path) == BIG_SIZE; });
+	measure("to_file_ex", [&] { return par_easycurl_to_file_ex(big.c_str(), path.c_str(), nullptr, quiet) && file_size(path) == BIG_SIZE; });
+	remove(path.c_str());
+
+	server.stop();
+	rmdir(dir.c_str());
+	std::cout << failed << " failed." << std::endl;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -17,23 +17,39 @@
 #include <sys/resource.h>
 #include <sys/soundcard.h>
 #include <sys/statfs.h>
+#include <sys/syscall.h>
 
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "datetime/crontab.h"
 #include "datetime/datetime.h"
+#include "datetime/deadline.h"
+#include "datetime/scheduler.h"
+#include "events/control.h"
+#include "events/events.h"
+#include "gtts/backend.h"
+#include "gtts/cache.h"
 #include "gtts/gtts.h"
 #include "gtts/mp3.h"
 #include "main.h"
 #include "par_easycurl.h"
+#include "printing/escpos.h"
 #include "simpleini/SimpleIni.h"
+#include "text/diacritics.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <numeric>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -41,6 +57,7 @@
 
 #define WORDSURL "https://raw.githubusercontent.com/ppiecuch/shared-assets/master/words.txt"
 #define LOCALCACHE "/tmp/words-memo.txt"
+#define LOCALCACHE_PART LOCALCACHE ".part"
 #define APPVERSION "0.9"
 
 struct FILEW {
@@ -168,112 +185,6 @@ static int create_directory(const std::string &path) {
 	}
 }
 
-std::wstring simplifieDiacritics(const std::wstring &str) {
-	static std::map<std::wstring, std::wstring> defaultDiacriticsRemovalMap = {
-		{ L"A", L"\u0041\u24B6\uFF21\u00C0\u00C1\u00C2\u1EA6\u1EA4\u1EAA\u1EA8\u00C3\u0100\u0102\u1EB0\u1EAE\u1EB4\u1EB2\u0226\u01E0\u00C4\u01DE\u1EA2\u00C5\u01FA\u01CD\u0200\u0202\u1EA0\u1EAC\u1EB6\u1E00\u0104\u023A\u2C6F" },
-		{ L"AA", L"\uA732" },
-		{ L"AE", L"\u00C6\u01FC\u01E2" },
-		{ L"AO", L"\uA734" },
-		{ L"AU", L"\uA736" },
-		{ L"AV", L"\uA738\uA73A" },
-		{ L"AY", L"\uA73C" },
-		{ L"B", L"\u0042\u24B7\uFF22\u1E02\u1E04\u1E06\u0243\u0182\u0181" },
-		{ L"C", L"\u0043\u24B8\uFF23\u0106\u0108\u010A\u010C\u00C7\u1E08\u0187\u023B\uA73E" },
-		{ L"D", L"\u0044\u24B9\uFF24\u1E0A\u010E\u1E0C\u1E10\u1E12\u1E0E\u0110\u018B\u018A\u0189\uA779" },
-		{ L"DZ", L"\u01F1\u01C4" },
-		{ L"Dz", L"\u01F2\u01C5" },
-		{ L"E", L"\u0045\u24BA\uFF25\u00C8\u00C9\u00CA\u1EC0\u1EBE\u1EC4\u1EC2\u1EBC\u0112\u1E14\u1E16\u0114\u0116\u00CB\u1EBA\u011A\u0204\u0206\u1EB8\u1EC6\u0228\u1E1C\u0118\u1E18\u1E1A\u0190\u018E" },
-		{ L"F", L"\u0046\u24BB\uFF26\u1E1E\u0191\uA77B" },
-		{ L"G", L"\u0047\u24BC\uFF27\u01F4\u011C\u1E20\u011E\u0120\u01E6\u0122\u01E4\u0193\uA7A0\uA77D\uA77E" },
-		{ L"H", L"\u0048\u24BD\uFF28\u0124\u1E22\u1E26\u021E\u1E24\u1E28\u1E2A\u0126\u2C67\u2C75\uA78D" },
-		{ L"I", L"\u0049\u24BE\uFF29\u00CC\u00CD\u00CE\u0128\u012A\u012C\u0130\u00CF\u1E2E\u1EC8\u01CF\u0208\u020A\u1ECA\u012E\u1E2C\u0197" },
-		{ L"J", L"\u004A\u24BF\uFF2A\u0134\u0248" },
-		{ L"K", L"\u004B\u24C0\uFF2B\u1E30\u01E8\u1E32\u0136\u1E34\u0198\u2C69\uA740\uA742\uA744\uA7A2" },
-		{ L"L", L"\u004C\u24C1\uFF2C\u013F\u0139\u013D\u1E36\u1E38\u013B\u1E3C\u1E3A\u0141\u023D\u2C62\u2C60\uA748\uA746\uA780" },
-		{ L"LJ", L"\u01C7" },
-		{ L"Lj", L"\u01C8" },
-		{ L"M", L"\u004D\u24C2\uFF2D\u1E3E\u1E40\u1E42\u2C6E\u019C" },
-		{ L"N", L"\u004E\u24C3\uFF2E\u01F8\u0143\u00D1\u1E44\u0147\u1E46\u0145\u1E4A\u1E48\u0220\u019D\uA790\uA7A4" },
-		{ L"NJ", L"\u01CA" },
-		{ L"Nj", L"\u01CB" },
-		{ L"O", L"\u004F\u24C4\uFF2F\u00D2\u00D3\u00D4\u1ED2\u1ED0\u1ED6\u1ED4\u00D5\u1E4C\u022C\u1E4E\u014C\u1E50\u1E52\u014E\u022E\u0230\u00D6\u022A\u1ECE\u0150\u01D1\u020C\u020E\u01A0\u1EDC\u1EDA\u1EE0\u1EDE\u1EE2\u1ECC\u1ED8\u01EA\u01EC\u00D8\u01FE\u0186\u019F\uA74A\uA74C" },
-		{ L"OI", L"\u01A2" },
-		{ L"OO", L"\uA74E" },
-		{ L"OU", L"\u0222" },
-		{ L"P", L"\u0050\u24C5\uFF30\u1E54\u1E56\u01A4\u2C63\uA750\uA752\uA754" },
-		{ L"Q", L"\u0051\u24C6\uFF31\uA756\uA758\u024A" },
-		{ L"R", L"\u0052\u24C7\uFF32\u0154\u1E58\u0158\u0210\u0212\u1E5A\u1E5C\u0156\u1E5E\u024C\u2C64\uA75A\uA7A6\uA782" },
-		{ L"S", L"\u0053\u24C8\uFF33\u1E9E\u015A\u1E64\u015C\u1E60\u0160\u1E66\u1E62\u1E68\u0218\u015E\u2C7E\uA7A8\uA784" },
-		{ L"T", L"\u0054\u24C9\uFF34\u1E6A\u0164\u1E6C\u021A\u0162\u1E70\u1E6E\u0166\u01AC\u01AE\u023E\uA786" },
-		{ L"TZ", L"\uA728" },
-		{ L"U", L"\u0055\u24CA\uFF35\u00D9\u00DA\u00DB\u0168\u1E78\u016A\u1E7A\u016C\u00DC\u01DB\u01D7\u01D5\u01D9\u1EE6\u016E\u0170\u01D3\u0214\u0216\u01AF\u1EEA\u1EE8\u1EEE\u1EEC\u1EF0\u1EE4\u1E72\u0172\u1E76\u1E74\u0244" },
-		{ L"V", L"\u0056\u24CB\uFF36\u1E7C\u1E7E\u01B2\uA75E\u0245" },
-		{ L"VY", L"\uA760" },
-		{ L"W", L"\u0057\u24CC\uFF37\u1E80\u1E82\u0174\u1E86\u1E84\u1E88\u2C72" },
-		{ L"X", L"\u0058\u24CD\uFF38\u1E8A\u1E8C" },
-		{ L"Y", L"\u0059\u24CE\uFF39\u1EF2\u00DD\u0176\u1EF8\u0232\u1E8E\u0178\u1EF6\u1EF4\u01B3\u024E\u1EFE" },
-		{ L"Z", L"\u005A\u24CF\uFF3A\u0179\u1E90\u017B\u017D\u1E92\u1E94\u01B5\u0224\u2C7F\u2C6B\uA762" },
-		{ L"a", L"\u0061\u24D0\uFF41\u1E9A\u00E0\u00E1\u00E2\u1EA7\u1EA5\u1EAB\u1EA9\u00E3\u0101\u0103\u1EB1\u1EAF\u1EB5\u1EB3\u0227\u01E1\u00E4\u01DF\u1EA3\u00E5\u01FB\u01CE\u0201\u0203\u1EA1\u1EAD\u1EB7\u1E01\u0105\u2C65\u0250" },
-		{ L"aa", L"\uA733" },
-		{ L"ae", L"\u00E6\u01FD\u01E3" },
-		{ L"ao", L"\uA735" },
-		{ L"au", L"\uA737" },
-		{ L"av", L"\uA739\uA73B" },
-		{ L"ay", L"\uA73D" },
-		{ L"b", L"\u0062\u24D1\uFF42\u1E03\u1E05\u1E07\u0180\u0183\u0253" },
-		{ L"c", L"\u0063\u24D2\uFF43\u0107\u0109\u010B\u010D\u00E7\u1E09\u0188\u023C\uA73F\u2184" },
-		{ L"d", L"\u0064\u24D3\uFF44\u1E0B\u010F\u1E0D\u1E11\u1E13\u1E0F\u0111\u018C\u0256\u0257\uA77A" },
-		{ L"dz", L"\u01F3\u01C6" },
-		{ L"e", L"\u0065\u24D4\uFF45\u00E8\u00E9\u00EA\u1EC1\u1EBF\u1EC5\u1EC3\u1EBD\u0113\u1E15\u1E17\u0115\u0117\u00EB\u1EBB\u011B\u0205\u0207\u1EB9\u1EC7\u0229\u1E1D\u0119\u1E19\u1E1B\u0247\u025B\u01DD" },
-		{ L"f", L"\u0066\u24D5\uFF46\u1E1F\u0192\uA77C" },
-		{ L"g", L"\u0067\u24D6\uFF47\u01F5\u011D\u1E21\u011F\u0121\u01E7\u0123\u01E5\u0260\uA7A1\u1D79\uA77F" },
-		{ L"h", L"\u0068\u24D7\uFF48\u0125\u1E23\u1E27\u021F\u1E25\u1E29\u1E2B\u1E96\u0127\u2C68\u2C76\u0265" },
-		{ L"hv", L"\u0195" },
-		{ L"i", L"\u0069\u24D8\uFF49\u00EC\u00ED\u00EE\u0129\u012B\u012D\u00EF\u1E2F\u1EC9\u01D0\u0209\u020B\u1ECB\u012F\u1E2D\u0268\u0131" },
-		{ L"j", L"\u006A\u24D9\uFF4A\u0135\u01F0\u0249" },
-		{ L"k", L"\u006B\u24DA\uFF4B\u1E31\u01E9\u1E33\u0137\u1E35\u0199\u2C6A\uA741\uA743\uA745\uA7A3" },
-		{ L"l", L"\u006C\u24DB\uFF4C\u0140\u013A\u013E\u1E37\u1E39\u013C\u1E3D\u1E3B\u017F\u0142\u019A\u026B\u2C61\uA749\uA781\uA747" },
-		{ L"lj", L"\u01C9" },
-		{ L"m", L"\u006D\u24DC\uFF4D\u1E3F\u1E41\u1E43\u0271\u026F" },
-		{ L"n", L"\u006E\u24DD\uFF4E\u01F9\u0144\u00F1\u1E45\u0148\u1E47\u0146\u1E4B\u1E49\u019E\u0272\u0149\uA791\uA7A5" },
-		{ L"nj", L"\u01CC" },
-		{ L"o", L"\u006F\u24DE\uFF4F\u00F2\u00F3\u00F4\u1ED3\u1ED1\u1ED7\u1ED5\u00F5\u1E4D\u022D\u1E4F\u014D\u1E51\u1E53\u014F\u022F\u0231\u00F6\u022B\u1ECF\u0151\u01D2\u020D\u020F\u01A1\u1EDD\u1EDB\u1EE1\u1EDF\u1EE3\u1ECD\u1ED9\u01EB\u01ED\u00F8\u01FF\u0254\uA74B\uA74D\u0275" },
-		{ L"oi", L"\u01A3" },
-		{ L"ou", L"\u0223" },
-		{ L"oo", L"\uA74F" },
-		{ L"p", L"\u0070\u24DF\uFF50\u1E55\u1E57\u01A5\u1D7D\uA751\uA753\uA755" },
-		{ L"q", L"\u0071\u24E0\uFF51\u024B\uA757\uA759" },
-		{ L"r", L"\u0072\u24E1\uFF52\u0155\u1E59\u0159\u0211\u0213\u1E5B\u1E5D\u0157\u1E5F\u024D\u027D\uA75B\uA7A7\uA783" },
-		{ L"s", L"\u0073\u24E2\uFF53\u00DF\u015B\u1E65\u015D\u1E61\u0161\u1E67\u1E63\u1E69\u0219\u015F\u023F\uA7A9\uA785\u1E9B" },
-		{ L"t", L"\u0074\u24E3\uFF54\u1E6B\u1E97\u0165\u1E6D\u021B\u0163\u1E71\u1E6F\u0167\u01AD\u0288\u2C66\uA787" },
-		{ L"tz", L"\uA729" },
-		{ L"u", L"\u0075\u24E4\uFF55\u00F9\u00FA\u00FB\u0169\u1E79\u016B\u1E7B\u016D\u00FC\u01DC\u01D8\u01D6\u01DA\u1EE7\u016F\u0171\u01D4\u0215\u0217\u01B0\u1EEB\u1EE9\u1EEF\u1EED\u1EF1\u1EE5\u1E73\u0173\u1E77\u1E75\u0289" },
-		{ L"v", L"\u0076\u24E5\uFF56\u1E7D\u1E7F\u028B\uA75F\u028C" },
-		{ L"vy", L"\uA761" },
-		{ L"w", L"\u0077\u24E6\uFF57\u1E81\u1E83\u0175\u1E87\u1E85\u1E98\u1E89\u2C73" },
-		{ L"x", L"\u0078\u24E7\uFF58\u1E8B\u1E8D" },
-		{ L"y", L"\u0079\u24E8\uFF59\u1EF3\u00FD\u0177\u1EF9\u0233\u1E8F\u00FF\u1EF7\u1E99\u1EF5\u01B4\u024F\u1EFF" },
-		{ L"z", L"\u007A\u24E9\uFF5A\u017A\u1E91\u017C\u017E\u1E93\u1E95\u01B6\u0225\u0240\u2C6C\uA763" },
-		{ L"!", L"\u00A1" },
-		{ L"?", L"\u00BF" },
-		{ L"..", L"\u1AB4\u2026" },
-	};
-
-	std::wstring ret = str;
-	for (const auto entry : defaultDiacriticsRemovalMap) {
-		for (const auto ch : entry.second) {
-			string_replace_all(ret, ch, entry.first);
-		}
-	}
-	return ret;
-}
-
-std::string trunc_wstring(const std::wstring &wide) {
-	std::string str(wide.length(), 0);
-	std::transform(wide.begin(), wide.end(), str.begin(), [](wchar_t c) { return (char)c; });
-	return str;
-}
-
 void init(void) {
 	struct sigaction sig;
 	setlocale(LC_TIME, "");
@@ -404,11 +315,12 @@ void update_hour(void) {
 	int ihour;
 	char tmpstr[128];
 
+	static std::tm now; // from the zone loaded once, not a libc lookup at every tick
 	ttyclock.lt = time(NULL);
-	ttyclock.tm = localtime(&(ttyclock.lt));
-	if (ttyclock.option.utc) {
-		ttyclock.tm = gmtime(&(ttyclock.lt));
-	}
+	if (ttyclock.option.utc)
+		ttyclock.tm = gmtime_r(&(ttyclock.lt), &now);
+	else
+		ttyclock.tm = datetime_utils::tz::local(ttyclock.lt, now);
 
 	ihour = ttyclock.tm->tm_hour;
 
@@ -622,12 +534,37 @@ void set_box(bool b) {
 	wrefresh(ttyclock.framewin);
 }
 
+#define UI_QUEUE 16
+
+// Actions scheduled by the internal cron or sent to the control socket,
+// run by the main loop like the matching keys.
+static const char *ui_actions[] = { "next", "print", "say", "refresh", "reload" };
+static event_ring<std::string, UI_QUEUE> ui_events;
+
+static bool ui_post(const std::string &action) {
+	return ui_events.push(action);
+}
+
+// Published by the main loop and the cron thread for the status command.
+static struct {
+	std::mutex m;
+	std::string clock, cron;
+} ui_status;
+
+static bool ui_action(const std::string &action) {
+	for (const char *a : ui_actions)
+		if (action == a)
+			return true;
+	return false;
+}
+
 std::string key_event() {
 	struct timespec length = { ttyclock.option.delay, ttyclock.option.nsdelay };
 
 	fd_set rfds;
 	FD_ZERO(&rfds);
 	FD_SET(STDIN_FILENO, &rfds);
+	FD_SET(ui_events.fd(), &rfds);
 
 	if (ttyclock.option.screensaver) {
 		int c = wgetch(stdscr);
@@ -642,7 +579,9 @@ std::string key_event() {
 					init_pair(2, i, ttyclock.bg);
 				}
 		}
-		return "";
+		std::string r;
+		ui_events.pop(r);
+		return r;
 	}
 
 	std::string r;
@@ -753,7 +692,11 @@ std::string key_event() {
 			break;
 
 		default:
-			pselect(1, &rfds, NULL, NULL, &length, NULL);
+			if (ui_events.pop(r))
+				break;
+			pselect(std::max(STDIN_FILENO, ui_events.fd()) + 1, &rfds, NULL, NULL, &length, NULL);
+			ui_events.drain();
+			ui_events.pop(r);
 	}
 
 	return r;
@@ -789,7 +732,9 @@ static std::string trim(std::string s) { return trimL(trimR(s)); }
 
 extern "C" char **environ;
 
-int run_cmd(const char *cmd, char *const *args) {
+// Runs the command and waits for it. The child pid is published while
+// it runs, so that it can be stopped from another thread.
+int run_cmd(const char *cmd, char *const *args, std::atomic<pid_t> *child = nullptr) {
 	pid_t pid;
 
 	posix_spawn_file_actions_t action;
@@ -801,7 +746,12 @@ int run_cmd(const char *cmd, char *const *args) {
 
 	int status = posix_spawnp(&pid, cmd, &action, nullptr, args, environ);
 	if (status == 0) {
-		if (waitpid(pid, &status, 0) != -1) {
+		if (child)
+			*child = pid;
+		const pid_t waited = waitpid(pid, &status, 0);
+		if (child)
+			*child = 0;
+		if (waited != -1) {
 			if (WIFEXITED(status)) {
 				return WEXITSTATUS(status);
 			} else {
@@ -836,16 +786,6 @@ bool exec_cmd(const char *cmd, char *result, int result_size) {
 	return true;
 }
 
-static bool write_file(const char *path, const void *data, int len) {
-	size_t n = 0;
-	if (FILE *ofp = fopen(path, "wb")) {
-		n = fwrite(data, 1, len, ofp);
-		fflush(ofp);
-		fclose(ofp);
-	}
-	return (n == len);
-}
-
 extern const unsigned char
 		div1[],
 		div2[];
@@ -862,144 +802,315 @@ const static embed_image_t dividers[] = {
 	{ nullptr, nullptr, 0, 0, 0, 0 }
 };
 
+static void tts_say(const std::string &memo);
+
 static void tts_memo(const std::string &line1, const std::string &line2) {
+	if (!line1.empty())
+		tts_say(line1);
 }
 
-static void print_memo(const std::string &line1, const std::string &line2, int d = 0) {
-	const char *prnt = "/tmp/DEVTERM_PRINTER_IN";
-
-#define ASCII_ESC 27 // Escape //0x1b
-#define ASCII_FS 28 // Field separator//0x1c
-#define ASCII_GS 29 // Group separator //0x1d
-
 #define MAX_DOTS 384
 #define MAX_BYTES (384 / 8)
 
-	const char *prnt_image = "\x1d\x76\x30"; // GS v 0 p wL wH hL hH d1…dk
-	const char *prnt_grey_image = "\x1d\x76\x31"; // GS v 1 p wL wH hL hH d1…dk
-
-	const char *prnt_uni = "\x1b\x21\x01";
-	const char *prnt_ascii = "\x1b\x21\x00";
-	const char *prnt_font3 = "\x1d\x21\x03";
-	const char *prnt_font4 = "\x1d\x21\x04";
+static printer_t printer;
 
+// Prints the card as one job: divider, date (of the request, now by
+// default), then the memo.
+static bool print_memo(const std::string &line1, const std::string &line2, int d = 0, time_t at = time_t(-1)) {
 	const embed_image_t div = dividers[d];
-	uint8_t div_hdr[5] = {
-		0,
-		uint8_t(div.width / 8), 0, // wL wH
-		uint8_t(div.height), 0, // hL hH
+
+	if (at == time_t(-1))
+		at = time(NULL);
+	std::tm tm;
+	char buffer[80];
+	size_t buffer_sz = strftime(buffer, 80, "%Y/%m/%d %H:%M:%S", localtime_r(&at, &tm));
+
+	print_job job;
+	job.raster(div.pixels, div.width / 8, div.height).feed(1);
+	job.mode(0).size(4).text(std::string((MAX_BYTES - buffer_sz) / 2, ' ')).raw(buffer, buffer_sz).feed(2);
+	job.mode(1).size(4).text(line1).size(3).text(line2).feed(10);
+
+	const int err = printer.submit(job);
+	if (err == EMSGSIZE) {
+		ERROR("Print job of %ld bytes, over %d: not printed.\n", long(job.wanted()), PRINT_JOB_SIZE);
+	} else if (err) {
+		ERROR("Printing to %s failed: %s.\n", printer.path().c_str(), strerror(err));
+	}
+	return err == 0;
+}
+
+/// PRINT SPOOLER
+
+#define PRINT_QUEUE 8 /* cards */
+
+// Prints the cards requested by the keys, the cron and the control socket
+// in its own thread, so a slow or stalled printer daemon never holds up
+// the clock. The queue is bounded and refuses new cards when full rather
+// than dropping queued ones: paper is not a display, the oldest request
+// is no less wanted. A card already waiting is not queued twice.
+struct print_spool_t {
+	typedef std::chrono::steady_clock clock;
+
+	void start() { thread = std::thread(&print_spool_t::run, this); }
+	void stop() {
+		{
+			std::lock_guard<std::mutex> l(m);
+			stopped = true;
+		}
+		cv.notify_all();
+		if (thread.joinable())
+			thread.join();
+	}
+	enum result_t {
+		queued,
+		coalesced, // same card already waiting
+		refused, // queue full
 	};
+	result_t push(const std::string &line1, const std::string &line2, int d = 0) {
+		{
+			std::lock_guard<std::mutex> l(m);
+			for (card_t &c : pending)
+				if (c.line1 == line1 && c.line2 == line2 && c.d == d) {
+					c.requests++, stats.coalesced++;
+					return coalesced;
+				}
+			if (pending.size() >= PRINT_QUEUE) {
+				stats.refused++;
+				return refused;
+			}
+			pending.push_back({ line1, line2, d, time(nullptr), clock::now(), 1 });
+		}
+		cv.notify_one();
+		return queued;
+	}
+	// Queue depth and latencies, for the status command.
+	std::string status() {
+		std::lock_guard<std::mutex> l(m);
+		return f_ssprintf("print %ld queued%s, %u printed (last %ld ms, worst %ld ms), %u failed, %u coalesced, %u refused",
+				long(pending.size()), busy ? " + 1 printing" : "", stats.printed, stats.last, stats.worst, stats.failed, stats.coalesced, stats.refused);
+	}
 
-	// divider
-	write_file(prnt, prnt_image, 3);
-	write_file(prnt, div_hdr, 5);
-	write_file(prnt, div.pixels, div.size);
-	write_file(prnt, "\n", 1);
+private:
+	struct card_t {
+		std::string line1, line2;
+		int d;
+		time_t at; // for the date printed
+		clock::time_point queued;
+		unsigned requests;
+	};
 
-	// date
-	time_t now(time(NULL));
-	char buffer[80];
-	size_t buffer_sz = strftime(buffer, 80, "%Y/%m/%d %H:%M:%S", localtime(&now));
-
-	write_file(prnt, prnt_ascii, 3);
-	write_file(prnt, prnt_font4, 3);
-	std::string padding((MAX_BYTES - buffer_sz) / 2, ' ');
-	write_file(prnt, padding.c_str(), padding.size());
-	write_file(prnt, buffer, buffer_sz);
-	write_file(prnt, "\n\n", 2);
-
-	// memo-card
-	write_file(prnt, prnt_uni, 3);
-	write_file(prnt, prnt_font4, 3);
-	if (!line1.empty())
-		write_file(prnt, line1.c_str(), line1.size());
-	write_file(prnt, prnt_font3, 3);
-	if (!line2.empty())
-		write_file(prnt, line2.c_str(), line2.size());
+	// At exit the queue is still printed, unless the printer fails.
+	void run() {
+		INFO("Print spooler started.\n");
+		std::unique_lock<std::mutex> l(m);
+		bool ok = true;
+		while (true) {
+			cv.wait(l, [&] { return stopped || !pending.empty(); });
+			if (pending.empty() || (stopped && !ok))
+				break;
+			const card_t card = pending.front();
+			pending.pop_front();
+			busy = true;
+			l.unlock();
+			const clock::time_point start = clock::now();
+			ok = print_memo(card.line1, card.line2, card.d, card.at);
+			const clock::time_point end = clock::now();
+			const long wait = std::chrono::duration_cast<std::chrono::milliseconds>(start - card.queued).count();
+			const long ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - card.queued).count();
+			l.lock();
+			busy = false;
+			if (ok) {
+				stats.printed++, stats.last = ms;
+				stats.worst = std::max(stats.worst, ms);
+			} else
+				stats.failed++;
+			LOG("Print job %s in %ld ms (%ld ms queued, %u requests), %ld pending.\n", ok ? "done" : "failed", ms, wait, card.requests, long(pending.size()));
+		}
+		INFO("Print spooler ended - %ld cards not printed, %u printed, %u failed.\n", long(pending.size()), stats.printed, stats.failed);
+	}
 
-	write_file(prnt, "\n\n\n\n\n\n\n\n\n\n", 10);
+	std::mutex m;
+	std::condition_variable cv;
+	std::deque<card_t> pending;
+	std::thread thread;
+	bool stopped = false, busy = false;
+	struct {
+		unsigned printed = 0, failed = 0, coalesced = 0, refused = 0;
+		long last = 0, worst = 0; // ms, request to the end of the write
+	} stats;
+} print_spool;
+
+static void print_card(const std::string &line1, const std::string &line2) {
+	switch (print_spool.push(line1 + "\n", line2 + "\n")) {
+		case print_spool_t::coalesced:
+			LOG("Print request merged with the card already queued.\n");
+			break;
+		case print_spool_t::refused:
+			LOG("Print queue full (%d cards), request refused.\n", PRINT_QUEUE);
+			break;
+		default:
+			break;
+	}
 }
 
 /// BACKGROUND THREADS
 
+// Sleeps of the cron thread, up to the deadline of the timer: interrupted
+// at exit, and cut short by wake() or when the watched descriptor is
+// readable.
 struct TimedWaiter {
 	void interrupt() {
-		auto l = lock();
 		interrupted = true;
-		cv.notify_all();
+		wake();
 	}
+	void wake() { (void)!write(fds[1], "", 1); }
 	// returns false if interrupted
-	template <class Rep, class Period>
-	bool wait_for(std::chrono::duration<Rep, Period> duration) const {
-		auto l = lock();
-		return !cv.wait_until(l, std::chrono::steady_clock::now() + duration, [&] { return interrupted; });
+	bool wait(const deadline_timer &timer, int fd = -1) const {
+		struct pollfd pfd[3] = { { fds[0], POLLIN, 0 }, { fd, POLLIN, 0 }, { timer.fd(), POLLIN, 0 } };
+		if (poll(pfd, 3, timer.poll_timeout()) > 0 && (pfd[0].revents & POLLIN) && !interrupted) {
+			char buf[64];
+			while (read(fds[0], buf, sizeof(buf)) > 0)
+				;
+		}
+		return !interrupted;
 	}
 
-private:
-	std::unique_lock<std::mutex> lock() const { return std::unique_lock<std::mutex>(m); }
-
-	mutable std::mutex m;
-	mutable std::condition_variable cv;
-	bool interrupted = false;
-} c_wait_timer, t_wait_timer;
-
-struct task_t {
-	time_t rawtime;
-	std::string task;
-};
+	TimedWaiter() { (void)!pipe2(fds, O_CLOEXEC | O_NONBLOCK); }
 
-static std::vector<task_t> cron_events;
+private:
+	int fds[2] = { -1, -1 };
+	std::atomic<bool> interrupted{ false };
+} c_wait_timer;
 
 using namespace datetime_utils::crontab;
 
-void cron_run() {
-	std::vector<std::string> crontab = {
-		"* */15 9-17 * * mon,tue,thu,fri daily",
-		"* */20 10-18 * * sat weekend1",
-		"* */30 12-18 * * sun weekend2",
-	};
-
-	INFO("Internal cron started with %ld entries.\n", crontab.size());
+static std::string crontab_path = "crontab.ini";
+static std::atomic<bool> cron_reload(false);
+
+// Applies the crontab file to the scheduler - the built-in entries when
+// there is no file. The command of an entry is one of the ui_actions.
+static void cron_load(scheduler &jobs, time_t now) {
+	entries_t entries;
+	policies_t policies;
+	std::vector<std::string> invalid;
+	const bool loaded = load_crontab(crontab_path, entries, &policies, &invalid);
+	for (auto it = entries.begin(); it != entries.end();) {
+		const std::string &line = it->second;
+		const size_t sp = line.find_last_of(' ');
+		if (sp == std::string::npos || !ui_action(line.substr(sp + 1))) {
+			ERROR("Crontab entry '%s' has no known action (next, print, say, refresh, reload).\n", it->first.c_str());
+			it = entries.erase(it);
+		} else
+			++it;
+	}
+	std::vector<std::string> rejected;
+	const size_t changes = loaded ? jobs.sync(entries, now, &rejected) : jobs.sync(crontab_defaults, now, &rejected);
+	jobs.missed(policies);
+	for (const std::string &name : rejected)
+		ERROR("Invalid crontab entry '%s'.\n", name.c_str());
+	for (const std::string &name : invalid)
+		ERROR("Invalid policy for the missed fires of '%s' (once, skip or all).\n", name.c_str());
+	INFO("Crontab %s: %ld entries, %ld changed.\n", loaded ? crontab_path.c_str() : "built-in", jobs.size(), changes);
+}
 
-	unsigned pause;
-	std::vector<task_t> tasks;
+void cron_run() {
+	scheduler jobs;
+	crontab_watch watch;
+	if (!watch.open(crontab_path))
+		ERROR("Cannot watch '%s', changes need a restart.\n", crontab_path.c_str());
+	deadline_timer deadline;
+	if (!deadline.open())
+		ERROR("No timerfd, changes of the clock are noticed at the next fire.\n");
+	cron_load(jobs, time(nullptr));
+
+	INFO("Internal cron started with %ld entries.\n", jobs.size());
+
+	long pause;
+	time_t logged(-1), last(time(nullptr));
 	do {
 		if (!ttyclock.running)
 			break;
 
-		for (const task_t &t : tasks) {
-		}
-
 		time_t Now(time(nullptr));
+		if (deadline.consume() == deadline_timer::clock_set || Now < last) {
+			INFO("The clock was set (%+ld sec. since the last wake-up).\n", long(Now - last));
+			if (Now + CLOCK_SET_BACK < last) // else the fires up to the previous time are not run again
+				jobs.restart(Now);
+		}
+		last = Now;
+		const bool changed = watch.changed();
+		if (cron_reload.exchange(false) || changed)
+			cron_load(jobs, Now);
+
+		jobs.run(Now, [&](size_t n, time_t at) {
+			if (Now - at > MISSED_GRACE)
+				LOG("The job \"%s\" missed its fire at %ld by %ld sec. (%s).\n", jobs.name(n).c_str(), at, long(Now - at), missed_name[jobs.missed(n)]);
+			LOG("The job \"%s\" fired (due at %ld): %s.\n", jobs.name(n).c_str(), at, jobs.job(n).expression().c_str());
+			if (!ui_post(jobs.job(n).expression()))
+				LOG("UI queue full, dropped the oldest action.\n");
+		});
+
+		const time_t rawtime(jobs.next());
+		deadline.arm(rawtime);
+		if (rawtime == time_t(-1)) {
+			INFO("No job to schedule.\n");
+			continue;
+		}
+		pause = std::max(long(rawtime - Now), 0L);
 
-		tasks.clear(), pause = 0;
-		for (int i = 0; i < crontab.size(); i++) {
-			cron c = crontab[i];
-			time_t rawtime = c.next_date(Now);
-			int schedule = rawtime - Now;
-
+		if (rawtime != logged) { // not again for unrelated wake-ups
 			char buffer[80];
-			strftime(buffer, 80, "%Y/%m/%d %H:%M:%S", localtime(&rawtime));
-			LOG("The job \"%s\" lanched at: %ld (%s), in %d sec. - \"%s\"\n", c.expression().c_str(), rawtime, buffer, schedule, crontab[i].c_str());
-
-			if (!pause || schedule < pause) {
-				pause = schedule;
-				tasks.assign({ { rawtime, c.expression() } });
-			} else if (schedule == pause) {
-				tasks.push_back({ rawtime, c.expression() });
-			}
+			std::tm tm;
+			strftime(buffer, 80, "%Y/%m/%d %H:%M:%S", localtime_r(&rawtime, &tm));
+			INFO("Waiting for %ld sec. - next job \"%s\" at %s.\n", pause, jobs.name(jobs.next_job()).c_str(), buffer);
+			logged = rawtime;
+			std::lock_guard<std::mutex> lock(ui_status.m);
+			ui_status.cron = f_ssprintf("next %s at %s", jobs.name(jobs.next_job()).c_str(), buffer);
 		}
+	} while (c_wait_timer.wait(deadline, watch.fd()));
 
-		if (pause > 0)
-			INFO("Waiting for %d sec.\n", pause);
-		else
-			pause = 1;
-	} while (c_wait_timer.wait_for(std::chrono::seconds(pause)));
+	INFO("Internal cron ended - %ld jobs pending.\n", jobs.pending());
+}
+
+/// CONTROL SOCKET
+
+static control_server_t control;
 
-	INFO("Internal cron ended - pending %ld tasks.\n", cron_events.size());
+static std::string control_command(const std::string &cmd) {
+	if (cmd == "status") {
+		std::lock_guard<std::mutex> lock(ui_status.m);
+		return ui_status.clock + "|" + (ui_status.cron.empty() ? "no job" : ui_status.cron) + "|" + print_spool.status();
+	}
+	if (!ui_action(cmd))
+		return "error: unknown command '" + cmd + "'";
+	if (cmd == "reload")
+		cron_reload = true, c_wait_timer.wake();
+	LOG("Control command: %s.\n", cmd.c_str());
+	return ui_post(cmd) ? "ok" : "ok, dropped an older action";
 }
 
-static std::vector<std::string> tts_events;
+void control_run() {
+	INFO("Control socket %s started.\n", control.path.c_str());
+	while (ttyclock.running && control.serve(1000, control_command))
+		;
+	control.close();
+	INFO("Control socket ended.\n");
+}
+
+#define TTS_QUEUE 4
+#define TTS_PCM_BUDGET (64 << 20) /* bytes */
+#define TTS_PCM_RATE 48000 /* Hz, of the decoded samples: the usual rate of sound devices */
+
+// Memos to speak, pushed by the render loop. The TTS thread sleeps on
+// the queue descriptor, so a new card starts playing right away.
+static event_ring<std::string, TTS_QUEUE> tts_events;
+
+// Logs the timings of the last download made by the calling thread.
+static void log_transfer(const char *what) {
+	const par_easycurl_stats st = par_easycurl_last_stats();
+	LOG("%s: HTTP %ld, %lld bytes in %.3f sec. (connect %.3f, first byte %.3f, %.1f KB/s)\n", what,
+			st.status, st.bytes, st.total_time, st.connect_time, st.first_byte_time, st.speed / 1024.0);
+}
 
 static bool is_mp3(const std::string &filename) {
 	FILEW file(filename.c_str(), "rb");
@@ -1010,54 +1121,430 @@ static bool is_mp3(const std::string &filename) {
 	return (buffer[0] == 'I' && buffer[1] == 'D' && buffer[2] == '3') || (buffer[0] == 0xFF && (buffer[1] & 0xE0) == 0xE0);
 }
 
-static std::string escape(std::string text) {
-	size_t start_pos = 0;
-	while ((start_pos = text.find(" ", start_pos)) != std::string::npos) {
-		text.replace(start_pos, 1, "%20");
-		start_pos += 3; // Handles case where 'to' is a substring of 'from'
+static std::string quote(const std::string &text) {
+	return "'" + text + "'";
+}
+
+static cache_index_t tts_cache;
+static uint64_t tts_budget = 128; /* MB */
+
+static std::string tts_lang = "es", tts_speed = "1.0"; // part of the cache key
+static std::string tts_engine_name = "google";
+static std::unique_ptr<tts_backend_t> tts_engine;
+static std::atomic<pid_t> tts_child(0);
+
+static int tts_spawn(const char *cmd, char *const *args) { return run_cmd(cmd, args, &tts_child); }
+
+// Synthesis backend: google, fake or an espeak compatible command.
+static tts_backend_t *tts_backend(const std::string &name) {
+	if (name == "google")
+		return new google_backend_t;
+	if (name == "fake")
+		return new fake_backend_t;
+	return new command_backend_t(name, &tts_spawn);
+}
+
+// Cache key of the memo sample: the hash of the text and of everything
+// else changing the audio (empty if the memo is not valid UTF-8).
+static std::string tts_clip(const std::string &memo) {
+	std::wstring res;
+	if (!ConvertUTF8toWide(memo.c_str(), res))
+		return "";
+	return cache_key(memo, tts_lang, tts_engine->voice(), tts_speed) + ".mp3";
+}
+
+// Downloads the memo sample into the cache. The sample is written aside
+// and renamed when complete, so concurrent fetches of the same memo never
+// leave a half-written file in the cache.
+static bool tts_fetch(const std::string &memo, const std::string &clip) {
+	static std::atomic<unsigned> serial(0);
+	const std::string mp3 = tts_cache.path(clip);
+	const std::string part = mp3 + f_ssprintf(".%u.part", serial++);
+	tts_cache.prepare(clip);
+	const std::string url = tts_engine->url(memo, tts_lang, tts_speed);
+	if (!url.empty())
+		LOG("Downloading sample \"%s\"\n", url.c_str());
+	if (!tts_engine->fetch(memo, tts_lang, tts_speed, part, flog))
+		LOG("  %s synthesis failed.\n", tts_engine->name());
+	if (!url.empty())
+		log_transfer("Sample download");
+	const size_t size = file_size(part);
+	if (!file_exists(part) || !is_mp3(part) || rename(part.c_str(), mp3.c_str()) != 0) {
+		remove(part.c_str());
+		return false;
 	}
-	return text;
+	tts_cache.insert(clip, size, memo);
+	return true;
 }
 
-static std::string quote(const std::string &text) {
-	return "'" + text + "'";
+static std::atomic<bool> tts_busy(false);
+static std::string tts_output = "/dev/dsp";
+
+// Audio output of the player: OSS device, WAV file, null or the
+// external player ("spawn").
+static pcm_sink_t *tts_sink(const std::string &output) {
+	if (output == "spawn")
+		return nullptr;
+	if (output == "null")
+		return new null_sink_t;
+	if (output.size() > 4 && output.compare(output.size() - 4, 4, ".wav") == 0)
+		return new wav_sink_t(output);
+	return new oss_sink_t(output);
+}
+
+/// TTS SAY
+
+#define TTS_SAY_BUDGET 150 /* ms, key to first sample on a cache hit */
+
+static gate_sink_t tts_gate;
+
+// Interactive speak request. It is served before the queued memos and
+// cancels the clip being played, including one of a previous request.
+struct say_t {
+	typedef std::chrono::steady_clock clock;
+
+	std::mutex m;
+	std::string memo;
+	clock::time_point at; // key press
+	bool pending = false;
+
+	// latency diagnostics
+	unsigned count = 0, over = 0;
+	long last = -1, worst = -1;
+
+	void push(const std::string &text) {
+		std::lock_guard<std::mutex> l(m);
+		memo = text, at = clock::now(), pending = true;
+		tts_gate.cancel();
+		if (pid_t pid = tts_child)
+			kill(pid, SIGTERM);
+	}
+
+	// Takes the pending request and opens the output for it.
+	bool take(std::string &text, clock::time_point &t) {
+		std::lock_guard<std::mutex> l(m);
+		if (!pending)
+			return false;
+		text.swap(memo), t = at, pending = false;
+		tts_gate.arm();
+		return true;
+	}
+
+	// Opens the output for a queued memo, unless a request came first.
+	void arm() {
+		std::lock_guard<std::mutex> l(m);
+		if (!pending)
+			tts_gate.arm();
+	}
+
+	// Key to first sample latency of a request just played (-1 if it
+	// went through the external player).
+	void played(clock::time_point t, bool hit) {
+		const long ms = tts_gate.started ? std::chrono::duration_cast<std::chrono::milliseconds>(tts_gate.first - t).count() : -1;
+		count++;
+		last = ms;
+		if (ms > worst)
+			worst = ms;
+		if (hit && ms > TTS_SAY_BUDGET)
+			over++;
+		if (ms < 0)
+			LOG("Say latency unknown (external player).\n");
+		else
+			LOG("Say latency %ld ms (%s)%s.\n", ms, hit ? "cache hit" : "fetched", hit && ms > TTS_SAY_BUDGET ? ", over budget" : "");
+	}
+} tts_urgent;
+
+static void tts_say(const std::string &memo) {
+	tts_urgent.push(memo);
+	tts_events.wake();
 }
 
 void tts_run() {
 	INFO("TTS module started.\n");
 
-	mad_player_t player(&run_cmd, flog);
-	int pause = 2;
+	std::unique_ptr<pcm_sink_t> sink(tts_sink(tts_output));
+	tts_gate.out = sink.get();
+	pcm_sink_t *out = sink ? &tts_gate : nullptr;
+	mad_player_t player(&tts_spawn, flog, out);
+	pcm_cache_t pcm("tts-cache/pcm", TTS_PCM_BUDGET, TTS_PCM_RATE);
+	std::string memo;
+	say_t::clock::time_point at;
+
+	auto play = [&](const std::string &clip) {
+		if (out && pcm.play(clip, out)) {
+			LOG("Played \"%s\" from decoded cache (%u hits, %u misses).\n", clip.c_str(), unsigned(pcm.hits), unsigned(pcm.misses));
+			return;
+		}
+		player.play(tts_cache.path(clip).c_str(), pcm.record(clip, player.decoder.ready() ? out : nullptr));
+	};
 
-	while (t_wait_timer.wait_for(std::chrono::seconds(pause))) {
-		if (!ttyclock.running)
-			break;
-		if (!tts_events.empty()) {
-			std::string memo = take(tts_events);
-			std::wstring res;
-			if (ConvertUTF8toWide(memo.c_str(), res)) {
-				std::string asc = trunc_wstring(simplifieDiacritics(res));
-				LOG("Processing memo \"%s\" in tts.\n", asc.c_str());
-				std::string mp3 = "tts-cache/" + asc + ".mp3";
-				if (file_exists(mp3) && is_mp3(mp3)) {
-					touch(mp3.c_str());
-					player.play(mp3.c_str()); // play mp3
-				} else {
-					std::string url = _tts + escape(memo) + _lang_opt + "es" + _client;
-					std::vector<const char *> hdrs{ _ref.c_str(), _agent.c_str(), 0 };
-					LOG("Downloading sample \"%s\"\n", url.c_str());
-					if (!par_easycurl_to_file_ex(url.c_str(), mp3.c_str(), hdrs.data(), flog))
-						LOG("  download failed.\n");
-					if (!file_exists(mp3) || !is_mp3(mp3))
-						LOG("Cannot play sound file \"%s\"\n", mp3.c_str());
-					else
-						player.play(mp3.c_str()); // play mp3
-				}
+	while (ttyclock.running) {
+		const bool urgent = tts_urgent.take(memo, at);
+		if (!urgent) {
+			if (!tts_events.pop(memo)) {
+				tts_events.wait(1000);
+				continue;
+			}
+			tts_urgent.arm();
+		}
+		if (!tts_engine->cacheable()) {
+			LOG("Speaking %smemo \"%s\" with %s.\n", urgent ? "requested " : "", fold_diacritics(memo).c_str(), tts_engine->name());
+			tts_busy = true;
+			tts_engine->speak(memo, tts_lang, tts_speed, out, flog);
+			if (urgent)
+				tts_urgent.played(at, false);
+			tts_busy = false;
+			continue;
+		}
+		std::string clip = tts_clip(memo);
+		if (!clip.empty()) {
+			LOG("Processing %smemo \"%s\" (%s) in tts.\n", urgent ? "requested " : "", fold_diacritics(memo).c_str(), clip.c_str());
+			tts_busy = true;
+			const bool hit = tts_cache.find(clip);
+			if (hit || tts_fetch(memo, clip)) {
+				play(clip);
+				if (urgent)
+					tts_urgent.played(at, hit);
+			} else {
+				LOG("Cannot play sound file \"%s\"\n", clip.c_str());
+			}
+			tts_busy = false;
+		}
+	}
+
+	INFO("TTS module ended - pending %ld tasks, %ld dropped, cache %ld samples (%llu KB), decoded cache %u hits, %u misses, %u requests (last %ld ms, worst %ld ms, %u over budget).\n",
+			tts_events.size(), tts_events.drops(), tts_cache.size(), (unsigned long long)tts_cache.bytes() >> 10, unsigned(pcm.hits), unsigned(pcm.misses),
+			tts_urgent.count, tts_urgent.last, tts_urgent.worst, tts_urgent.over);
+}
+
+/// TTS PREFETCH
+
+#define TTS_LOOKAHEAD 3
+#define TTS_PREFETCH_WORKERS 2
+
+// Downloads samples of the upcoming cards in the background, so playing
+// them is a cache hit. Workers run at the lowest priority and stay idle
+// while the TTS thread is fetching or playing.
+struct prefetch_t {
+	void start(int workers) {
+		for (int i = 0; i < workers; i++)
+			threads.emplace_back(&prefetch_t::run, this);
+	}
+	void stop() {
+		{
+			std::lock_guard<std::mutex> l(m);
+			stopped = true;
+		}
+		cv.notify_all();
+		for (std::thread &t : threads)
+			t.join();
+		threads.clear();
+	}
+	void push(const std::string &memo) {
+		{
+			std::lock_guard<std::mutex> l(m);
+			if (queued.count(memo))
+				return;
+			queued.insert(memo);
+			pending.push_back(memo);
+			while (pending.size() > 2 * TTS_LOOKAHEAD) { // stale lookahead
+				queued.erase(pending.front());
+				pending.pop_front();
+			}
+		}
+		cv.notify_one();
+	}
+
+private:
+	void run() {
+#ifndef __APPLE__
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+		std::unique_lock<std::mutex> l(m);
+		while (true) {
+			cv.wait_for(l, std::chrono::seconds(1), [&] { return stopped || (!pending.empty() && !tts_busy); });
+			if (stopped)
+				break;
+			if (pending.empty() || tts_busy)
+				continue;
+			const std::string memo = pending.front();
+			pending.pop_front();
+			l.unlock();
+			const std::string clip = tts_clip(memo);
+			if (!clip.empty() && !tts_cache.contains(clip)) {
+				LOG("Prefetching memo \"%s\".\n", clip.c_str());
+				if (!tts_fetch(memo, clip))
+					LOG("Prefetch of \"%s\" failed.\n", clip.c_str());
 			}
+			l.lock();
+			queued.erase(memo);
+		}
+	}
+
+	std::mutex m;
+	std::condition_variable cv;
+	std::deque<std::string> pending;
+	std::set<std::string> queued; // pending or in flight
+	std::vector<std::thread> threads;
+	bool stopped = false;
+} tts_prefetch;
+
+/// TTS WARM-UP
+
+#define TTS_WARMUP_RATE 4 /* requests per second and host */
+
+// Spaces out the requests sent to every host.
+struct rate_limit_t {
+	typedef std::chrono::steady_clock clock;
+
+	std::mutex m;
+	std::map<std::string, clock::time_point> next;
+	clock::duration gap;
+
+	void wait(const std::string &url) {
+		const size_t from = url.find("://") == std::string::npos ? 0 : url.find("://") + 3;
+		const std::string host = url.substr(from, url.find('/', from) - from);
+		clock::time_point at;
+		{
+			std::lock_guard<std::mutex> l(m);
+			at = std::max(clock::now(), next[host]);
+			next[host] = at + gap;
+		}
+		std::this_thread::sleep_until(at);
+	}
+
+	rate_limit_t(int per_second) :
+			gap(std::chrono::microseconds(1000000 / per_second)) {}
+};
+
+// Fetches the samples of every card missing from the cache, then exits.
+// Samples already in the cache index are skipped, so an interrupted
+// warm-up resumes where it stopped.
+static bool tts_warmup(CSimpleIniA &ini, int workers) {
+	if (!tts_engine->cacheable()) {
+		printf("Warm-up: nothing to fetch, %s samples are not cached.\n", tts_engine->name());
+		return true;
+	}
+	std::vector<std::string> memos;
+	std::set<std::string> clips;
+	size_t cached = 0;
+	CSimpleIniA::TNamesDepend sects;
+	ini.GetAllSections(sects);
+	for (const auto &sect : sects) {
+		CSimpleIniA::TNamesDepend keys;
+		ini.GetAllKeys(sect.pItem, keys);
+		for (const auto &key : keys) {
+			const std::string s = ini.GetValue(sect.pItem, key.pItem, "");
+			const std::string memo = trim(s.substr(0, s.find("::")));
+			const std::string clip = tts_clip(memo);
+			if (memo.empty() || clip.empty() || !clips.insert(clip).second)
+				continue;
+			if (tts_cache.contains(clip))
+				cached++;
+			else
+				memos.push_back(memo);
+		}
+	}
+	printf("Warm-up: %zu samples, %zu cached, %zu to fetch with %d workers.\n", clips.size(), cached, memos.size(), workers);
+
+	rate_limit_t limit(TTS_WARMUP_RATE);
+	std::atomic<size_t> next(0), done(0), failed(0);
+	std::atomic<unsigned long long> bytes(0);
+	std::mutex out;
+	const auto start = std::chrono::steady_clock::now();
+
+	auto work = [&] {
+		for (size_t i; (i = next++) < memos.size();) {
+			const std::string clip = tts_clip(memos[i]);
+			const std::string url = tts_engine->url(memos[i], tts_lang, tts_speed);
+			if (!url.empty())
+				limit.wait(url);
+			if (tts_fetch(memos[i], clip))
+				bytes += file_size(tts_cache.path(clip));
+			else
+				failed++;
+			const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::lock_guard<std::mutex> l(out);
+			printf("\r  %zu/%zu, %zu failed, %.1f samples/s, %.1f KB/s ", ++done, memos.size(), size_t(failed), done / secs, bytes / 1024.0 / secs);
+			fflush(stdout);
+		}
+	};
+	std::vector<std::thread> pool;
+	for (int w = 0; w < workers; w++)
+		pool.emplace_back(work);
+	for (std::thread &t : pool)
+		t.join();
+
+	printf("%sWarm-up done: %zu fetched, %zu failed, cache %ld samples (%llu of %llu MB).\n", memos.empty() ? "" : "\n", memos.size() - failed, size_t(failed),
+			tts_cache.size(), (unsigned long long)tts_cache.bytes() >> 20, (unsigned long long)tts_budget);
+	if (tts_cache.bytes() >= (tts_budget << 20) * 9 / 10)
+		printf("Warning: the cache is close to its budget and evicts samples, raise it with -M.\n");
+	return failed == 0;
+}
+
+/// WORDS REFRESH
+
+// Schedules downloads of WORDSURL: exponential backoff with jitter after
+// a failure and a circuit breaker after too many of them in a row, so an
+// outage is served from the last good cache instead of a retry loop.
+struct refresh_t {
+	enum state_t {
+		closed, // refreshing normally
+		backoff, // retrying after failure
+		open // giving up for a longer while
+	} state = closed;
+
+	int failures = 0;
+	time_t next_attempt = 0;
+
+	static const int base_delay = 15; /* sec */
+	static const int max_delay = 900; /* sec */
+	static const int open_after = 6; /* failures */
+	static const int open_delay = 3600; /* sec */
+
+	bool due(time_t now) const { return now >= next_attempt; }
+	void success(time_t now) {
+		state = closed;
+		failures = 0;
+		next_attempt = now;
+	}
+	void failure(time_t now) {
+		int delay;
+		if (++failures >= open_after) {
+			state = open;
+			delay = open_delay;
+		} else {
+			state = backoff;
+			delay = base_delay << (failures - 1);
+			if (delay > max_delay)
+				delay = max_delay;
 		}
+		next_attempt = now + delay / 2 + rand() % (delay / 2 + 1); // jitter
 	}
+	std::string status(time_t now) const {
+		const long left = std::max<long>(0, next_attempt - now);
+		switch (state) {
+			case backoff:
+				return f_ssprintf("|Retry %lds", left);
+			case open:
+				return f_ssprintf("|Offline %ldm", (left + 59) / 60);
+			default:
+				return "";
+		}
+	}
+};
 
-	INFO("TTS module ended - pending %ld tasks.\n", tts_events.size());
+// Loads the words cache in place of the words held: SimpleIni merges a
+// file into what it holds, so keys removed from the file would stay. The
+// words held are kept when the file cannot be opened.
+static SI_Error load_words(CSimpleIniA &ini) {
+	FILE *fp = fopen(LOCALCACHE, "rb");
+	if (!fp)
+		return SI_FILE;
+	ini.Reset();
+	const SI_Error rc = ini.LoadFile(fp);
+	fclose(fp);
+	return rc;
 }
 
 /// MAIN LOOP
@@ -1066,7 +1553,7 @@ int main(int argc, char **argv) {
 	int c;
 	int refreshrate = 30; /* sec */
 	bool dump_flag = false, print_flag = false;
-	int print_index = -1;
+	int print_index = -1, warmup_workers = 0;
 
 #ifdef DEBUG
 #ifndef __APPLE__
@@ -1093,11 +1580,11 @@ int main(int argc, char **argv) {
 	ttyclock.option.nsdelay = 0; /* -0FPS */
 	ttyclock.option.blink = false;
 
-	while ((c = getopt(argc, argv, "ikuvsScbtp:P:rR:hBwxnDC:f:d:T:a:V")) != -1) {
+	while ((c = getopt(argc, argv, "ikuvsScbtp:P:rR:hBwxnDC:f:d:T:a:A:E:F:J:K:L:M:W:V")) != -1) {
 		switch (c) {
 			case 'h':
 			default:
-				printf("usage : my-word-memo [-iuvsScbtrahDBxnV] [-C [0-7]] [-f format] [-d delay] [-a nsdelay] [-T tty] \n"
+				printf("usage : my-word-memo [-iuvsScbtrahDBxnV] [-C [0-7]] [-f format] [-d delay] [-a nsdelay] [-T tty] [-A output] [-E engine] [-F speed] [-J crontab] [-K command] [-L lang] [-M size] [-W workers] \n"
 					   "    -s            Show seconds                                   \n"
 					   "    -S            Screensaver mode                               \n"
 					   "    -x            Show box                                       \n"
@@ -1110,6 +1597,15 @@ int main(int argc, char **argv) {
 					   "    -p            Print given memo (-1 for random)               \n"
 					   "    -P            TTS given memo (-1 for random)                 \n"
 					   "    -R            Words-memo display refresh rate                \n"
+					   "    -A output     TTS audio: OSS device, file.wav, null or spawn \n"
+					   "    -E engine     TTS engine: google, fake or espeak-ng          \n"
+					   "    -F speed      TTS speed factor, 0.1 to 3. Default 1.0.       \n"
+					   "    -J crontab    Crontab INI file. Default crontab.ini.         \n"
+					   "    -K command    Send to the running clock: print, next, say,   \n"
+					   "                  refresh, reload or status                      \n"
+					   "    -L lang       TTS language code. Default es.                 \n"
+					   "    -M size       TTS cache budget in MB. Default 128MB.         \n"
+					   "    -W workers    Fetch all missing TTS samples and exit         \n"
 					   "    -r            Do rebound the clock                           \n"
 					   "    -f format     Set the date format                            \n"
 					   "    -n            Don't quit on keypress                         \n"
@@ -1186,6 +1682,50 @@ int main(int argc, char **argv) {
 			case 'w':
 				dump_flag = true;
 				break;
+			case 'A':
+				tts_output = optarg;
+				break;
+			case 'E':
+				tts_engine_name = optarg;
+				break;
+			case 'F': {
+				const double speed = atof(optarg);
+				if (speed < 0.1 || speed > 3) {
+					fprintf(stderr, "TTS speed out of range: %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				tts_speed = f_ssprintf("%.2f", speed);
+				while (tts_speed.back() == '0' && tts_speed[tts_speed.size() - 2] != '.') // same key for "1" and "1.0"
+					tts_speed.pop_back();
+			} break;
+			case 'J':
+				crontab_path = optarg;
+				break;
+			case 'K': {
+				std::string reply;
+				const std::string path = control_path();
+				if (!control_send(path, optarg, &reply)) {
+					fprintf(stderr, path.empty() ? "No private directory for the control socket.\n" : "No clock running on %s.\n", path.c_str());
+					exit(EXIT_FAILURE);
+				}
+				puts(reply.c_str());
+				exit(reply.compare(0, 6, "error:") == 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+			} break;
+			case 'L':
+				if (!lang_codes.count(optarg)) {
+					fprintf(stderr, "Unknown TTS language: %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				tts_lang = optarg;
+				break;
+			case 'M':
+				if (atol(optarg) > 0)
+					tts_budget = atol(optarg);
+				break;
+			case 'W':
+				if (atoi(optarg) > 0 && atoi(optarg) <= 32)
+					warmup_workers = atoi(optarg);
+				break;
 			case 'x':
 				ttyclock.option.box = true;
 				break;
@@ -1218,6 +1758,12 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	// curl's global state is not thread safe: set it up before any worker downloads
+	par_easycurl_init(0);
+	atexit(par_easycurl_shutdown);
+
+	tts_engine.reset(tts_backend(tts_engine_name));
+
 	struct timeval t1, t2;
 	double elapsedTime = 9999, fileEdge = 9999; /* sec */
 
@@ -1225,6 +1771,8 @@ int main(int argc, char **argv) {
 
 	std::string line1, line2, selection;
 
+	refresh_t refresh;
+
 	CSimpleIniA ini;
 	ini.SetUnicode();
 
@@ -1246,11 +1794,14 @@ int main(int argc, char **argv) {
 			curr %= seq.size();
 			return seq[curr++];
 		}
+		int peek(int n) const { // n-th upcoming element
+			return seq[(curr + n) % seq.size()];
+		}
 		bool empty() const { return seq.empty(); }
 		size_t size() const { return seq.size(); }
 	} seq;
 
-	if (dump_flag || print_flag) {
+	if (dump_flag || print_flag || warmup_workers) {
 		if (!file_exists(LOCALCACHE)) {
 			if (par_easycurl_to_file(WORDSURL, LOCALCACHE)) {
 				SI_Error rc = ini.LoadFile(LOCALCACHE);
@@ -1287,6 +1838,10 @@ int main(int argc, char **argv) {
 				printf(" %s = %d values\n", it->pItem, ini.GetSectionSize(it->pItem));
 			}
 			printf("==================\n");
+		} else if (warmup_workers) {
+			if (!tts_cache.open("tts-cache", ".mp3", tts_budget << 20, &is_mp3))
+				ERROR("Unable to open TTS cache index\n");
+			return tts_warmup(ini, warmup_workers) ? 0 : 1;
 		} else if (print_flag) {
 			const char *sect = sects.begin()->pItem; // first section
 
@@ -1316,8 +1871,21 @@ int main(int argc, char **argv) {
 	init();
 	attron(A_BLINK);
 
-	std::thread cron_thrd(cron_run);
+	const std::string control_socket = control_path();
+	const bool control_ok = control.open(control_socket);
+	if (!control_ok)
+		ERROR("No control socket: %s.\n", control_socket.empty() ? "no private directory for it" : (control_socket + " is in use or cannot be created").c_str());
+
+	std::thread cron_thrd(cron_run), control_thrd;
+	if (control_ok)
+		control_thrd = std::thread(control_run);
+	if (!tts_cache.open("tts-cache", ".mp3", tts_budget << 20, &is_mp3))
+		ERROR("Unable to open TTS cache index\n");
+
 	std::thread tts_thrd(tts_run);
+	print_spool.start();
+	if (tts_engine->cacheable())
+		tts_prefetch.start(TTS_PREFETCH_WORKERS);
 
 	/* Create status win */
 	WINDOW *status = newwin(1, COLS, LINES - 1, 0);
@@ -1331,14 +1899,25 @@ int main(int argc, char **argv) {
 	srand(time(NULL));
 
 	while (ttyclock.running) {
-		if (!file_exists(LOCALCACHE) || ini.GetSectionsSize() == 0 || fileEdge > 900) {
-			if (par_easycurl_to_file(WORDSURL, LOCALCACHE)) {
-				SI_Error rc = ini.LoadFile(LOCALCACHE);
+		if ((!file_exists(LOCALCACHE) || ini.GetSectionsSize() == 0 || fileEdge > 900) && refresh.due(time(NULL))) {
+			// download aside, so a failed transfer never clobbers the last good cache
+			const bool downloaded = par_easycurl_to_file(WORDSURL, LOCALCACHE_PART);
+			log_transfer("Words download");
+			if (downloaded && rename(LOCALCACHE_PART, LOCALCACHE) == 0) {
+				refresh.success(time(NULL));
+				SI_Error rc = load_words(ini);
 				if (rc < 0) {
 					endwin();
 					ERROR("Unable to load words data (error 0x%X)\n", rc);
 					return 100;
 				}
+			} else {
+				refresh.failure(time(NULL));
+				LOG("Words refresh failed (%d in a row), next attempt in %ld sec.\n", refresh.failures, refresh.next_attempt - time(NULL));
+				if (ini.GetSectionsSize() == 0 && file_exists(LOCALCACHE)) {
+					if (ini.LoadFile(LOCALCACHE) < 0)
+						LOG("Unable to load last words cache.\n");
+				}
 			}
 		}
 		clock_rebound();
@@ -1365,7 +1944,16 @@ int main(int argc, char **argv) {
 					line1 = trim(s.substr(0, s.find(delimiter)));
 					line2 = trim(s.substr(s.find(delimiter) + 2));
 
-					tts_events.push_back(line1);
+					if (!tts_events.push(line1))
+						LOG("TTS queue full, dropped the oldest memo.\n");
+
+					for (int i = 0; i < TTS_LOOKAHEAD && i < seq.size(); i++) {
+						std::string ahead = f_ssprintf("%d", seq.peek(i));
+						if (ini.KeyExists(sect, ahead.c_str())) {
+							std::string v = ini.GetValue(sect, ahead.c_str());
+							tts_prefetch.push(trim(v.substr(0, v.find(delimiter))));
+						}
+					}
 				} else {
 					key += "!";
 				}
@@ -1399,25 +1987,37 @@ int main(int argc, char **argv) {
 			strftime(file_ctime, 128, "|Cache %H:%M", localtime(&(attr.st_mtime)));
 		}
 		wbkgdset(status, COLOR_PAIR(1));
-		std::string stats = f_ssprintf("v%s|%d%s%s", APPVERSION, int(refreshrate - elapsedTime), file_ctime, selection.c_str());
+		std::string stats = f_ssprintf("v%s|%d%s%s%s", APPVERSION, int(refreshrate - elapsedTime), file_ctime, refresh.status(time(NULL)).c_str(), selection.c_str());
 		if (stats.size() < COLS)
 			stats.insert(stats.size(), COLS - stats.size(), ' ');
 		mvwaddstr(status, 0, 0, stats.c_str());
 		wrefresh(status);
+		{
+			std::lock_guard<std::mutex> lock(ui_status.m);
+			ui_status.clock = trim(stats) + "|" + line1;
+		}
 		std::string ev = key_event();
 		if (ev == "print")
-			print_memo(line1 + "\n", line2 + "\n");
+			print_card(line1, line2);
 		else if (ev == "next")
 			elapsedTime = refreshrate;
-		else if (ev == "tts")
+		else if (ev == "say")
 			tts_memo(line1, line2);
+		else if (ev == "refresh")
+			fileEdge = 9999; // download the words again
+		else if (ev == "reload" && load_words(ini) < 0)
+			LOG("Unable to reload the words cache.\n");
 	}
 
 	endwin();
 
 	// clean up
-	c_wait_timer.interrupt(), t_wait_timer.interrupt();
+	c_wait_timer.interrupt(), tts_events.wake();
 	cron_thrd.join(), tts_thrd.join();
+	if (control_thrd.joinable())
+		control_thrd.join();
+	tts_prefetch.stop();
+	print_spool.stop();
 
 	flog.close();
 
@@ -1,3 +1,4 @@
+#include <poll.h>
 #include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,10 +8,16 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "datetime/crontab.h"
 #include "datetime/datetime.h"
+#include "datetime/deadline.h"
+#include "datetime/scheduler.h"
+#include "events/control.h"
 #include "par_easycurl.h"
 #include "simpleini/SimpleIni.h"
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -28,6 +35,7 @@
     _ss_ret; })
 
 using namespace datetime_utils::crontab;
+namespace tz = datetime_utils::tz;
 
 // Reference:
 // ----------
@@ -76,41 +84,243 @@ std::vector<std::string> read_file(const char *filename) {
 	return r;
 }
 
+/// CHECK MODE
+
+// Expressions the checks always run on: ranges, steps, lists, names,
+// last day of the month, weekend and year fields. They are parsed at
+// compile time too, and both parses must agree.
+static constexpr cron_spec check_corpus[] = {
+	"0 */15 9-17 * * mon,tue,thu,fri print"_cron,
+	"0 */20 10-18 * * sat print"_cron,
+	"0 */30 12-18 * * sun print"_cron,
+	"30 0 8 * * MON-FRI next"_cron,
+	"0 0 12 * * * next"_cron,
+	"0 30 8 L * * next"_cron,
+	"0 0 0 L * SUN next"_cron,
+	"0 0 0 1 * MON next"_cron,
+	"0 15 10 1,15 JAN-JUN * next"_cron,
+	"15 10 * * JAN,JUL * next"_cron,
+	"0 0 0 29 FEB * next"_cron,
+	"0 0 0 31 * * next"_cron,
+	"5,10 * * 13 * FRI next"_cron,
+	"*/7 3 * * * * next"_cron,
+	"*/10 * 7 * * * next"_cron,
+	"0 0 9 * * W next"_cron,
+	"0 0 6 * * * 2027 next"_cron,
+	"0 0 0 1 1 * 2026-2030 next"_cron,
+	"* * * * JUL * next"_cron,
+	"* * * 5 * * next"_cron,
+	"* * * * * * next"_cron,
+	"0 */5 * * * * next"_cron,
+	"0 45 23 * DEC SAT next"_cron,
+};
+
+#define CHECK_WINDOW 86400 /* sec, searched second by second */
+#define CHECK_SAMPLES 16
+#define CHECK_CHANGE (8 * 3600) /* sec, around the clock changes */
+#define CHECK_ROUNDS 2000
+
+// Reference search: steps second by second from t (after it for the next
+// date, down to it for the previous one) and returns the first time the
+// cron matches, -1 if none in the window. The clock changes follow the
+// rule of next_date(): unless the job runs every hour, times skipped fire
+// at the transition and times repeated only fire the first time.
+static time_t check_scan(const cron &c, time_t t, bool next) {
+	const bool fixed(!c.every_hour());
+	std::tm tm, w;
+	time_t minute(-1);
+	long off(0), before(0); // offsets in the minute and just before it
+	for (long i(next); i <= CHECK_WINDOW; i++) {
+		const time_t x(next ? t + i : t - i), m(x - x % 60);
+		if (m != minute) { // zone offsets are whole minutes
+			const time_t b(m - 1);
+			before = localtime_r(&b, &w)->tm_gmtoff;
+			off = localtime_r(&(minute = m), &tm)->tm_gmtoff;
+		}
+		tm.tm_sec = int(x - m);
+		if (fixed && x == m && before < off) // clock set forward at x
+			for (time_t s(x + before); s < x + off; s++)
+				if (c.matches(*gmtime_r(&s, &w)))
+					return x;
+		if (!c.matches(tm))
+			continue;
+		if (fixed) { // is it the second time for this local time?
+			const time_t d(x - 86400), y(x + off - localtime_r(&d, &w)->tm_gmtoff);
+			if (y < x && localtime_r(&y, &w)->tm_gmtoff == x + off - y)
+				continue;
+		}
+		return x;
+	}
+	return time_t(-1);
+}
+
+// The dates found are compared with the scan from random times, from times
+// shortly before (or after) a fire, so rare schedules are covered, and
+// from around the clock changes of the zone.
+static bool check_entry(const std::string &line, const cron_spec *spec = nullptr) {
+	cron c(line);
+	if (c.error()) {
+		std::cout << "  INVALID  " << line << std::endl;
+		return false;
+	}
+	if (spec && cron(*spec) != c) {
+		std::cout << "  MISMATCH " << line << ": the compile-time parse differs" << std::endl;
+		return false;
+	}
+	int bad(0);
+	unsigned seed(std::hash<std::string>()(line));
+	const time_t now(time(NULL));
+	for (int k(0); k < CHECK_SAMPLES; k++)
+		for (int next(0); next < 2; next++) {
+			time_t t(now + long(rand_r(&seed) % (400 * 86400L)));
+			const std::shared_ptr<const tz::zone> z(tz::zone::current());
+			if ((k & 2) && z && z->covers(t)) { // within hours of a clock change, or right at it
+				const int64_t change(z->segment(t).end);
+				if (change != INT64_MAX)
+					t = time_t(change) - next + (k == 2 ? 0 : long(rand_r(&seed) % CHECK_CHANGE) - CHECK_CHANGE / 2);
+			} else if (k & 1) { // close to a fire
+				const time_t f(next ? c.next_date(t) : c.previous_date(t));
+				if (f != time_t(-1))
+					t = next ? f - 1 - rand_r(&seed) % (CHECK_WINDOW / 2) : f + rand_r(&seed) % (CHECK_WINDOW / 2);
+			}
+			const time_t got(next ? c.next_date(t) : c.previous_date(t)), want(check_scan(c, t, next));
+			const bool in_window(got != time_t(-1) && (next ? got - t : t - got) <= CHECK_WINDOW);
+			if ((in_window || want != time_t(-1)) && got != want) {
+				auto date = [](time_t x) {
+					char buffer[32] = "none";
+					std::tm tm;
+					if (x != time_t(-1))
+						strftime(buffer, 32, "%Y/%m/%d %H:%M:%S", localtime_r(&x, &tm));
+					return std::string(buffer);
+				};
+				if (bad++ < 3)
+					std::cout << "  MISMATCH " << line << ": " << (next ? "next" : "previous") << " of " << date(t) << " is " << date(got) << ", scan found " << date(want) << std::endl;
+			}
+		}
+
+	const auto t0(std::chrono::steady_clock::now());
+	for (int i(0); i < CHECK_ROUNDS; i++)
+		c.clear() = line;
+	const auto t1(std::chrono::steady_clock::now());
+	time_t t(now);
+	volatile time_t sink(0); // keeps the loops
+	for (int i(0); i < CHECK_ROUNDS; i++, t += 3607)
+		sink += c.next_date(t);
+	const auto t2(std::chrono::steady_clock::now());
+	for (int i(0); i < CHECK_ROUNDS; i++, t += 3607)
+		sink += c.previous_date(t);
+	const auto t3(std::chrono::steady_clock::now());
+	auto ns = [](std::chrono::steady_clock::duration d) { return long(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / CHECK_ROUNDS); };
+
+	std::cout << (bad ? "  FAIL " : "  ok   ") << line << " - assign " << ns(t1 - t0) << " ns, next " << ns(t2 - t1) << " ns, previous " << ns(t3 - t2) << " ns" << std::endl;
+	return bad == 0;
+}
+
+static bool check_entry(const cron_spec &spec) { return check_entry(spec.source, &spec); }
+
+// Checks the corpus and the crontab entries. Returns the exit status.
+template <typename T>
+static int check(const T &entries) {
+	int failed(0);
+	std::cout << "Corpus:" << std::endl;
+	for (const cron_spec &spec : check_corpus)
+		failed += !check_entry(spec);
+	std::cout << "Crontab:" << std::endl;
+	for (const auto &e : entries)
+		failed += !check_entry(e.second);
+	std::cout << failed << " failed." << std::endl;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/// MAIN
+
 int main(int argc, char **argv) {
-	std::vector<std::string> crontab = {
-		"* */15 9-17 * * mon,tue,thu,fri daily",
-		"* */20 10-18 * * sat weekend1",
-		"* */30 12-18 * * sun weekend2",
-	};
+	bool check_flag(false);
+	for (int c; (c = getopt(argc, argv, "ch")) != -1;)
+		switch (c) {
+			case 'c':
+				check_flag = true;
+				break;
+			default:
+				std::cout << "usage : my-words-memo-cron [-c] [crontab]" << std::endl
+						  << "    -c    Check the cron evaluation against a brute-force scan," << std::endl
+						  << "          with timings, on a corpus and the crontab entries" << std::endl;
+				return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
 
-	char *exec[] = PRINTCMD;
+	const std::string path(optind < argc ? argv[optind] : "crontab.ini");
 
-	for (;;) {
-		time_t Now(time(NULL));
-		cron c;
+	if (check_flag) {
+		entries_t entries;
+		return load_crontab(path, entries) ? check(entries) : check(crontab_defaults);
+	}
 
-		unsigned pause = 0;
+	char *exec[] = PRINTCMD;
 
-		for (int i(0); i < crontab.size(); i++) {
-			c.clear() = crontab[i];
-			time_t rawtime = c.next_date(Now);
-			int schedule = rawtime - Now;
+	scheduler jobs;
+	crontab_watch watch;
+	if (!watch.open(path))
+		std::cerr << APPNAME ": cannot watch \"" << path << "\"" << std::endl;
 
-			char buffer[80];
-			strftime(buffer, 80, "%Y/%m/%d %H:%M:%S", localtime(&rawtime));
-			std::cout << "The job \"" << c.expression() << "\" lanched at: " << rawtime << " (" << buffer << "), in " << schedule << " sec. - \"" << crontab[i] << "\"" << std::endl;
+	time_t logged(-1);
+	deadline_timer deadline;
+	if (!deadline.open())
+		std::cerr << APPNAME ": no timerfd, changes of the clock are noticed at the next fire" << std::endl;
 
-			if (!pause || schedule < pause) {
-				pause = schedule;
-			}
+	time_t last(time(NULL));
+	for (bool reload(true);; reload = watch.changed()) {
+		if (reload) {
+			entries_t entries;
+			policies_t policies;
+			std::vector<std::string> rejected, invalid;
+			const bool loaded = load_crontab(path, entries, &policies, &invalid);
+			const size_t changes = loaded ? jobs.sync(entries, time(NULL), &rejected) : jobs.sync(crontab_defaults, time(NULL), &rejected);
+			jobs.missed(policies);
+			for (const std::string &name : rejected)
+				std::cerr << APPNAME ": invalid crontab entry \"" << name << "\"" << std::endl;
+			for (const std::string &name : invalid)
+				std::cerr << APPNAME ": invalid policy for the missed fires of \"" << name << "\" (once, skip or all)" << std::endl;
+			std::cout << "Crontab " << (loaded ? path : "built-in") << ": " << jobs.size() << " entries, " << changes << " changed." << std::endl;
+		}
+
+		time_t Now(time(NULL));
+		if (deadline.consume() == deadline_timer::clock_set || Now < last) {
+			std::cout << "The clock was set (" << Now - last << " sec. since the last wake-up)." << std::endl;
+			if (Now + CLOCK_SET_BACK < last) // else the fires up to the previous time are not run again
+				jobs.restart(Now);
 		}
+		last = Now;
+
+		jobs.run(Now, [&](size_t n, time_t at) {
+			if (Now - at > MISSED_GRACE)
+				std::cout << "The job \"" << jobs.name(n) << "\" missed its fire at " << at << " by " << Now - at << " sec. (" << missed_name[jobs.missed(n)] << ")." << std::endl;
+			// a running clock does it in-process, else a print is spawned
+			const std::string action(jobs.job(n).expression());
+			std::string reply;
+			if (control_send(control_path(), action, &reply))
+				std::cout << "Sent \"" << action << "\": " << reply << std::endl;
+			else if (action == "print") {
+				std::cout << "Executing." << std::endl;
+				run_cmd(exec);
+			} else
+				std::cerr << APPNAME ": no clock running for \"" << action << "\"" << std::endl;
+		});
 
-		if (pause > 0) {
-			std::cout << "Waiting for " << pause << " sec." << std::endl;
-			sleep(pause);
+		const time_t rawtime = jobs.next();
+		deadline.arm(rawtime);
+		if (rawtime != time_t(-1) && rawtime != logged) { // not again for unrelated wake-ups
+			const long schedule(rawtime - Now);
+			char buffer[80];
+			std::tm tm;
+			strftime(buffer, 80, "%Y/%m/%d %H:%M:%S", localtime_r(&rawtime, &tm));
+			std::cout << "The job \"" << jobs.name(jobs.next_job()) << "\" lanched at: " << rawtime << " (" << buffer << "), in " << schedule << " sec." << std::endl;
+			std::cout << "Waiting for " << schedule << " sec." << std::endl;
+			logged = rawtime;
 		}
-		std::cout << "Executing." << std::endl;
-		run_cmd(exec);
+
+		// up to the fire time, a change of the crontab or of the clock
+		struct pollfd pfd[2] = { { watch.fd(), POLLIN, 0 }, { deadline.fd(), POLLIN, 0 } };
+		poll(pfd, 2, deadline.poll_timeout());
 	}
 }
 
@@ -1,13 +1,22 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
 #include <iostream>
 #include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "modules/gtts/gtts.h"
+#include "par_easycurl.h"
 
 int main(int argc, char *argv[]) {
 	std::string argv0 = argv[0];
@@ -59,10 +68,6 @@ int main(int argc, char *argv[]) {
 
 /// GTTS
 
-static std::string quote(const std::string &text) {
-	return "'" + text + "'";
-}
-
 GoogleTTS::GoogleTTS(std::string msg, std::string lang, std::string speed) {
 	_speed += speed;
 	_lang += lang;
@@ -94,26 +99,73 @@ std::vector<std::string> GoogleTTS::split(std::string &msg) {
 	return vec;
 }
 
-void GoogleTTS::unite() {
-	system(_cat.c_str());
-	system(_rm.c_str());
+bool GoogleTTS::fetch(const std::string &url, std::string &mp3) {
+	const char *hdrs[] = { _ref.c_str(), _agent.c_str(), 0 };
+	par_byte *data = nullptr;
+	int nbytes = 0;
+	if (!par_easycurl_to_memory_ex(url.c_str(), &data, &nbytes, hdrs, stderr))
+		return false;
+	mp3.assign(reinterpret_cast<char *>(data), nbytes);
+	free(data);
+	return true;
 }
 
+// Chunks are downloaded concurrently and piped to the player in order as
+// soon as they arrive, so playing starts with the first chunk whatever
+// the length of the text.
 void GoogleTTS::execute() {
-	if (_cmds.size() == 1) {
-		if (verbose)
-			std::cout << _cmds[0] << std::endl;
-		std::system(_cmds[0].c_str());
-	} else {
-		for (std::string cmd : _cmds) {
-			if (verbose)
-				std::cout << cmd << std::endl;
-			std::system(cmd.c_str());
-		}
-		this->unite();
+	enum { pending, done, failed };
+	struct chunk_t {
+		std::string mp3;
+		int state = pending;
+	};
+	std::vector<chunk_t> chunks(_urls.size());
+	std::mutex m;
+	std::condition_variable cv;
+	std::atomic<size_t> next(0);
+
+	if (verbose)
+		for (const std::string &url : _urls)
+			std::cout << url << std::endl;
+
+	par_easycurl_init(0);
+	std::vector<std::thread> workers;
+	for (size_t w = 0; w < _urls.size() && w < _fetch_workers; w++) {
+		workers.emplace_back([&] {
+			for (size_t i; (i = next++) < _urls.size();) {
+				std::string mp3;
+				const bool ok = fetch(_urls[i], mp3);
+				std::lock_guard<std::mutex> l(m);
+				chunks[i].mp3.swap(mp3);
+				chunks[i].state = ok ? done : failed;
+				cv.notify_all();
+			}
+		});
 	}
+
+	signal(SIGPIPE, SIG_IGN); // the player may exit early
 	_mpv += _speed + _play;
-	std::system(_mpv.c_str());
+	FILE *player = popen(_mpv.c_str(), "w");
+	if (!player)
+		std::cerr << "Cannot start the player: " << _mpv << std::endl;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		std::string mp3;
+		{
+			std::unique_lock<std::mutex> l(m);
+			cv.wait(l, [&] { return chunks[i].state != pending; });
+			if (chunks[i].state == failed)
+				std::cerr << "Cannot download chunk " << i << ": " << _urls[i] << std::endl;
+			mp3.swap(chunks[i].mp3);
+		}
+		if (player && !mp3.empty()) {
+			fwrite(mp3.data(), 1, mp3.size(), player);
+			fflush(player);
+		}
+	}
+	if (player)
+		pclose(player);
+	for (std::thread &t : workers)
+		t.join();
 }
 
 void GoogleTTS::replace(std::string &text) {
@@ -126,18 +178,13 @@ void GoogleTTS::replace(std::string &text) {
 
 void GoogleTTS::parse() {
 	replace(_text);
-	std::string cmd = _curl + "'" + _tts + _text + _lang + _client + "' -H " + quote(_ref) + " -H " + quote(_agent) + _out + " 2>/dev/null";
-	_cmds.push_back(cmd);
+	_urls.push_back(_tts + _text + _lang + _client);
 }
 
 void GoogleTTS::parse(std::vector<std::string> &vec) {
-	std::string cmd = "";
-	int i = 0;
 	for (std::string msg : vec) {
 		replace(msg);
-		cmd = _curl + "'" + _tts + msg + _lang + _client + "' -H " + quote(_ref) + " -H " + quote(_agent) + _outv + std::to_string(i) + ".mp3" + " 2>/dev/null";
-		_cmds.push_back(cmd);
-		i++;
+		_urls.push_back(_tts + msg + _lang + _client);
 	}
 }
 
@@ -0,0 +1,130 @@
+#ifndef CRONTAB_H
+#define CRONTAB_H
+
+// Crontab file: the [crontab] section of an INI file, one job per key
+//
+//   [crontab]
+//   daily = 0 */15 9-17 * * mon,tue,thu,fri print
+//
+// with the line in the "S M H d m w [Y] cmd" format, and the optional
+// [missed] section, giving what to do with the fires of a job missed
+// while the machine was suspended or the clock was set forward:
+//
+//   [missed]
+//   daily = skip
+//
+// with once (the default), skip or all.
+//
+// The file is watched with inotify, so it can be edited while the program
+// runs.
+//
+// Reference:
+// ----------
+// https://man7.org/linux/man-pages/man7/inotify.7.html
+
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <string>
+#include <vector>
+
+#include "scheduler.h"
+#include "../simpleini/SimpleIni.h"
+
+namespace datetime_utils {
+
+namespace crontab {
+
+static const char *crontab_section = "crontab";
+static const char *missed_section = "missed";
+
+// Jobs of the clock when there is no crontab file, parsed at compile time.
+static constexpr builtin_t crontab_defaults[] = {
+	{ "daily", "0 */15 9-17 * * mon,tue,thu,fri print"_cron },
+	{ "weekend1", "0 */20 10-18 * * sat print"_cron },
+	{ "weekend2", "0 */30 12-18 * * sun print"_cron },
+};
+
+// Reads the entries of the file, and their policies for missed fires if
+// asked (the names of the jobs with an unknown policy go in invalid).
+// False if the file cannot be loaded.
+inline bool load_crontab(const std::string &path, entries_t &entries, policies_t *policies = nullptr, std::vector<std::string> *invalid = nullptr) {
+	CSimpleIniA ini;
+	if (ini.LoadFile(path.c_str()) < 0)
+		return false;
+	CSimpleIniA::TNamesDepend keys;
+	ini.GetAllKeys(crontab_section, keys);
+	entries.clear();
+	for (const auto &key : keys)
+		entries[key.pItem] = ini.GetValue(crontab_section, key.pItem, "");
+	if (policies) {
+		policies->clear();
+		keys.clear();
+		ini.GetAllKeys(missed_section, keys);
+		for (const auto &key : keys) {
+			missed_t p;
+			if (missed_policy(ini.GetValue(missed_section, key.pItem, ""), p))
+				(*policies)[key.pItem] = p;
+			else if (invalid)
+				invalid->push_back(key.pItem);
+		}
+	}
+	return true;
+}
+
+// Change notifications for one file. The directory is watched rather than
+// the file: editors often write a copy and rename it over the original,
+// and the file may not exist yet.
+class crontab_watch {
+	int _fd = -1, _wd = -1;
+	std::string _name;
+
+public:
+	bool open(const std::string &path) {
+#ifdef __linux__
+		const size_t slash(path.rfind('/'));
+		const std::string dir(slash == std::string::npos ? "." : path.substr(0, slash + 1));
+		_name = (slash == std::string::npos ? path : path.substr(slash + 1));
+		if ((_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+			return false;
+		_wd = inotify_add_watch(_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+		return _wd >= 0;
+#else
+		return false;
+#endif
+	};
+
+	// Readable when changed() has something to report (-1 if not watching).
+	inline int fd(void) const { return _fd; };
+
+	// Consumes the pending notifications: true if the file was written,
+	// replaced or removed since the last call.
+	bool changed(void) {
+		bool hit(false);
+#ifdef __linux__
+		alignas(struct inotify_event) char buf[4096];
+		ssize_t n;
+		while (_fd >= 0 && (n = read(_fd, buf, sizeof(buf))) > 0)
+			for (char *p = buf; p < buf + n;) {
+				const struct inotify_event *e = reinterpret_cast<const struct inotify_event *>(p);
+				if (e->len && _name == e->name)
+					hit = true;
+				p += sizeof(struct inotify_event) + e->len;
+			}
+#endif
+		return hit;
+	};
+
+	~crontab_watch() {
+		if (_fd >= 0)
+			close(_fd);
+	};
+};
+
+} //namespace crontab
+
+} // namespace datetime_utils
+
+#endif // CRONTAB_H
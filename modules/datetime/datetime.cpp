@@ -9,8 +9,8 @@ datetime::datetime() :
 	// Default constructor get current date and time
 	time_t rawtime;
 	time(&rawtime);
-	struct tm *tm_now = localtime(&rawtime);
-	_copy_from(tm_now);
+	struct tm tm_now;
+	_copy_from(localtime_r(&rawtime, &tm_now));
 }
 
 datetime::datetime(int year,
@@ -279,14 +279,9 @@ void datetime::add_hours(int nb_hours) { add_seconds(nb_hours * ONE_HOUR); }
 void datetime::add_minutes(int nb_minutes) { add_seconds(nb_minutes * ONE_MINUTE); }
 
 void datetime::add_seconds(int nb_seconds) {
-	struct tm *tm_new_time;
+	struct tm tm_new_time;
 	time_t new_seconds = mktime(timeInfo) + nb_seconds;
-	delete timeInfo;
-
-	tm_new_time = localtime(&new_seconds);
-
-	timeInfo = new tm();
-	_copy_from(tm_new_time);
+	_copy_from(localtime_r(&new_seconds, &tm_new_time));
 }
 
 bool datetime::is_leapyear() {
@@ -554,17 +549,6 @@ bool operator!=(const timespan &mts, const timespan &ots) { return !(mts == ots)
 
 namespace crontab {
 
-byte cron::index(field_name const nfield) {
-	static bool b(false);
-	static byte index[field_name::year] = { 0 };
-	if (!b) {
-		b = true;
-		for (byte i(1); i <= field_name::year; i++)
-			index[i] = index[i - 1] + field_size[i - 1];
-	}
-	return index[nfield];
-}
-
 cron &cron::assign(std::string s) {
 	byte i(0);
 	std::string second;
@@ -589,6 +573,28 @@ cron &cron::assign(std::string s) {
 			conv_error(true);
 			break;
 		}
+	if (!conv_error())
+		build_masks();
+	return (conv_error() ? clear() : *this);
+}
+
+// The years of the spec out of the scope of years are left out, as the
+// parser rejects them.
+cron &cron::assign(const cron_spec &spec) {
+	clear();
+	conv_error(false);
+	for (byte n(0); n < field_name::year; n++)
+		for (byte i(0); i < field_size[n]; i++)
+			set(index(field_name(n)) + i, spec.bits[n] >> i & 1);
+	for (byte i(0); i < field_size[field_name::year]; i++)
+		set(index(field_name::year) + i, spec.has_year(1900 + _year - SCOPE_OF_YEARS + i));
+	_last_is_set = spec.last;
+	_expression = spec.command;
+	for (byte i(0); !conv_error() && i <= field_name::year; i++)
+		if (is_not_set(field_name(i)))
+			conv_error(true);
+	if (!conv_error())
+		build_masks();
 	return (conv_error() ? clear() : *this);
 }
 
@@ -618,10 +624,11 @@ void cron::set_field(field_name const nfield, std::string first, bool v) {
 		else
 			set_scope(nfield, v, atoi(first.c_str()), atoi(second.c_str()));
 	} else if (split_string(first, "/", second)) {
-		if ((first.compare("*") != 0 && !is_numeric(normalize_field(nfield, first))) || !is_numeric(second))
+		if ((first.compare("*") != 0 && !is_numeric(normalize_field(nfield, first))) || !is_numeric(second) || atoi(second.c_str()) == 0)
 			conv_error(true);
 		else {
-			set_scope(nfield, v, atoi(first.c_str()), field_size[nfield] - 1, atoi(second.c_str()));
+			const byte from(first.compare("*") == 0 ? field_offset[nfield] : atoi(first.c_str()));
+			set_scope(nfield, v, from, field_size[nfield] - 1 + field_offset[nfield], atoi(second.c_str()));
 		}
 	} else if (first.compare("*") == 0) {
 		set_field(nfield, v);
@@ -669,87 +676,200 @@ std::string &cron::normalize_field(field_name const nfield, std::string &s) {
 	return s;
 }
 
-cron &cron::init_ref(std::tm &timeinfo, int *tminfo[]) {
-	static cron date;
-	mktime(&timeinfo); //call mktime to recompute timeinfo...
-	tminfo[0] = &timeinfo.tm_sec;
-	tminfo[1] = &timeinfo.tm_min;
-	tminfo[2] = &timeinfo.tm_hour;
-	tminfo[3] = &timeinfo.tm_mday;
-	tminfo[4] = &timeinfo.tm_mon;
-	tminfo[5] = &timeinfo.tm_wday;
-	tminfo[6] = &timeinfo.tm_year;
-	return date.assign(&timeinfo);
+// Civil calendar (proleptic Gregorian), with no time zone involved.
+// Reference: http://howardhinnant.github.io/date_algorithms.html
+
+static inline bool leap_year(int y) { return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0; }
+
+static inline int days_in_month(int y, int mon) { // tm_year, tm_mon
+	static const byte days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	return days[mon] + (mon == 1 && leap_year(1900 + y));
+}
+
+static inline int weekday_of(int y, int mon, int d) { // tm_year, tm_mon, tm_mday
+	y += 1900 - (mon < 2);
+	const long era = (y >= 0 ? y : y - 399) / 400;
+	const unsigned yoe = unsigned(y - era * 400);
+	const unsigned doy = (153 * (mon + (mon < 2 ? 10 : -2)) + 2) / 5 + d - 1;
+	const long days = era * 146097 + long(yoe * 365 + yoe / 4 - yoe / 100 + doy) - 719468;
+	return int((days % 7 + 11) % 7); // 1970-01-01 is a thursday
+}
+
+static inline int bit_from(uint64_t m, int x) { // lowest set bit >= x
+	if (x > 63)
+		return -1;
+	m &= ~uint64_t(0) << (x < 0 ? 0 : x);
+	return m ? __builtin_ctzll(m) : -1;
+}
+
+static inline int bit_upto(uint64_t m, int x) { // highest set bit <= x
+	if (x < 0)
+		return -1;
+	if (x < 63)
+		m &= (uint64_t(2) << x) - 1;
+	return m ? 63 - __builtin_clzll(m) : -1;
+}
+
+// mktime() with a hint of daylight saving time: the same local time may
+// happen twice when the clock goes back, and with tm_isdst = -1 glibc
+// picks one from the previous conversion, whatever the thread that made
+// it. Trying the hint first, then the other one, keeps the result stable.
+// Serialized: with TZ unset, every mktime() reloads the zone name inside
+// glibc, under a lock ThreadSanitizer cannot see.
+static time_t local_time(const std::tm &tm, int isdst) {
+	static std::mutex m;
+	std::lock_guard<std::mutex> lock(m);
+	std::tm t(tm);
+	t.tm_isdst = isdst;
+	const time_t r(mktime(&t));
+	if (isdst < 0 || (t.tm_hour == tm.tm_hour && t.tm_min == tm.tm_min && t.tm_mday == tm.tm_mday))
+		return r;
+	t = tm, t.tm_isdst = !isdst; // the hint does not apply at that date
+	const time_t o(mktime(&t));
+	return (t.tm_hour == tm.tm_hour && t.tm_min == tm.tm_min && t.tm_mday == tm.tm_mday) ? o : r;
+}
+
+// Fields are searched from the year down: seconds, minutes, hours, days
+// (day of month and day of week together), months and years. A wildcard
+// fires for every value of its field, as in crontab: "* */15" fires for
+// every second of the minute at each quarter, "0 */15" once.
+void cron::build_masks(void) {
+	for (byte n(0); n <= field_name::year; n++) {
+		_mask[n] = 0;
+		for (byte i(0); i < field_size[n]; i++)
+			if (is_set(field_name(n), i))
+				_mask[n] |= uint64_t(1) << (i + (n == field_name::day_of_month));
+	}
+}
+
+// Days of the month firing, as bits 1..31.
+uint64_t cron::days_of(int y, int mon) const {
+	static const uint64_t weekly = 0x0102040810204081ULL; // bits 0, 7, 14, ...
+	const int dim = days_in_month(y, mon), first = weekday_of(y, mon, 1);
+	uint64_t dow = 0;
+	for (int wd(0); wd < 7; wd++)
+		if (_mask[field_name::day_of_week] & (uint64_t(1) << wd))
+			dow |= weekly << (1 + (wd - first + 7) % 7);
+	uint64_t dom = _mask[field_name::day_of_month] | (_last_is_set ? uint64_t(1) << dim : 0);
+	return dom & dow & ((uint64_t(2) << dim) - 2);
+}
+
+bool cron::matches(const std::tm &t) const {
+	if (conv_error() || (_mask[field_name::second] == 0))
+		return false;
+	const int y(t.tm_year - (_year - SCOPE_OF_YEARS));
+	if (y < 0 || y >= field_size[field_name::year])
+		return false;
+	return (_mask[field_name::second] >> t.tm_sec & 1) && (_mask[field_name::minute] >> t.tm_min & 1) && (_mask[field_name::hour_of_day] >> t.tm_hour & 1) && (_mask[field_name::month] >> t.tm_mon & 1) && (_mask[field_name::year] >> y & 1) && (days_of(t.tm_year, t.tm_mon) >> t.tm_mday & 1);
 }
 
-time_t cron::date_around(const std::tm &timeinfo, bool next) {
-	bool match(true);
-	if (conv_error())
-		return time_t(-1);
+// Wall clock search: the first local time firing from t on (or the last
+// one up to t), whatever the zone. t may have tm_sec = 60.
+bool cron::find_date(std::tm &t, bool next) const {
+	if (conv_error() || (_mask[field_name::second] == 0))
+		return false;
+
+	const int base(_year - SCOPE_OF_YEARS); // tm_year of the year bit 0
+	// seconds, minutes, hours, day of month, month, year
+	int v[6] = { t.tm_sec, t.tm_min, t.tm_hour, t.tm_mday, t.tm_mon, t.tm_year - base };
+	auto reset = [&](int below) { // lower fields to their first (or last) value
+		static const byte last[] = { 59, 59, 23, 0, 11 };
+		for (int l(below - 1); l >= 0; l--)
+			v[l] = next ? (l == 3) : (l == 3 ? days_in_month(v[5] + base, v[4]) : last[l]);
+	};
+	static const byte field_of[] = { field_name::second, field_name::minute, field_name::hour_of_day, field_name::day_of_month, field_name::month, field_name::year };
+	for (int l(5); l >= 0;) {
+		const uint64_t m(l == 3 ? days_of(v[5] + base, v[4]) : _mask[field_of[l]]);
+		const int found(next ? bit_from(m, v[l]) : bit_upto(m, v[l]));
+		if (found < 0) { // carry into the upper field
+			if (l == 5)
+				return false; // out of the scope of years
+			l++;
+			v[l] += next ? 1 : -1;
+			if (l == 4 && (v[4] < 0 || v[4] > 11)) {
+				v[4] = next ? 0 : 11;
+				v[5] += next ? 1 : -1;
+				l = 5;
+			}
+			reset(l);
+			continue;
+		}
+		if (found != v[l]) {
+			v[l] = found;
+			reset(l);
+		}
+		l--;
+	}
+
+	t = std::tm();
+	t.tm_sec = v[0], t.tm_min = v[1], t.tm_hour = v[2];
+	t.tm_mday = v[3], t.tm_mon = v[4], t.tm_year = v[5] + base;
+	return true;
+}
+
+// Through mktime(), when the zone is not loaded: local times skipped or
+// repeated by a change of offset are resolved the way mktime() does.
+time_t cron::date_around(const std::tm &timeinfo, bool next) const {
 	std::tm result(timeinfo);
-	for (byte nfield(0); existing_field(nfield); nfield++) {
-		int delta(0), *tminfo[7];
-		cron &date(init_ref(result, tminfo));
-		int month_size((nfield == field_name::day_of_month) ? size_of_month(result) : 0);
-		byte i(date.find_bit(field_name(nfield), 0)), j(i);
-		if (i == npos)
+	result.tm_sec += next;
+	if (!find_date(result, next))
+		return time_t(-1);
+	return local_time(result, timeinfo.tm_isdst);
+}
+
+// Searched one offset of the zone at a time, in the order of the instants.
+// When the clock changes, jobs with a fixed hour fire once: at the
+// transition if their time was skipped, and on the first pass if it is
+// repeated. Jobs running every hour skip the missing times, and run again
+// in the repeated hour.
+time_t cron::date_around(const time_t &rawtime, bool next) const {
+	const std::shared_ptr<const tz::zone> z(tz::zone::current());
+	if (!z || !z->covers(rawtime)) {
+		std::tm t;
+		return date_around(*localtime_r(&rawtime, &t), next);
+	}
+	const bool fixed(!every_hour());
+	std::tm t;
+	for (int64_t from(int64_t(rawtime) + next);;) {
+		const tz::zone::segment_t s(z->segment(time_t(from)));
+		int64_t w(from + s.off);
+		if (next && fixed && s.prev_off > s.off) // not the repeated times again
+			w = std::max(w, s.start + s.prev_off);
+		if (next && fixed && s.prev_off < s.off && from == s.start) // the times skipped at from
+			w = from + s.prev_off;
+		tz::local_fields(w, t);
+		if (!find_date(t, next))
 			return time_t(-1);
-
-		if (is_set(field_name(nfield)) && !(nfield == field_name::year && match)) {
-			tminfo[nfield] = 0;
-			if (nfield < field_name::year)
+		const int64_t found(tz::local_seconds(t));
+		if (next) {
+			if (found - s.off < s.start)
+				from = s.start; // skipped: at the transition
+			else if (found - s.off < s.end)
+				from = found - s.off;
+			else if (fixed && s.next_off > s.off && found < s.end + s.next_off)
+				from = s.end; // skipped: at the transition
+			else {
+				from = s.end;
 				continue;
-		} else
-			while (true) {
-				if (is_set(field_name(nfield), i) || (nfield == field_name::day_of_month && i == month_size - 1 && _last_is_set))
-					break;
-				delta += (next ? 1 : -1);
-				if (((i += (next ? 1 : -1)) >= (month_size ? month_size : field_size[nfield])))
-					i = (next ? 0 : ((month_size ? month_size : field_size[nfield]) - 1));
-				if (i == j) {
-					if (nfield == field_name::day_of_month) {
-						delta = (next ? 1 : -1);
-						nfield++;
-						break;
-					} else
-						return time_t(-1);
-				}
 			}
-
-		if (delta) {
-			match = false;
-			if (nfield == field_name::day_of_week) {
-				*tminfo[field_name::day_of_month] += delta;
-				nfield -= 2;
-			} else {
-				*tminfo[nfield] += delta;
-			};
-			while (existing_field(--nfield)) {
-				month_size = ((nfield == field_name::day_of_month) ? size_of_month(result) : 0);
-				*tminfo[nfield] = (next ? ((nfield == field_name::day_of_month) ? 1 : 0) : (month_size ? month_size : field_size[nfield] - 1));
+		} else {
+			if (fixed && s.prev_off > s.off && found < s.start + s.prev_off) {
+				from = s.start - 1; // repeated: the first pass
+				continue;
+			}
+			if (found - s.off >= s.start)
+				from = found - s.off;
+			else if (fixed && s.prev_off < s.off && found >= s.start + s.prev_off)
+				from = s.start; // skipped: at the transition
+			else {
+				from = s.start - 1;
+				continue;
 			}
-		} else if (nfield == field_name::year && (match || !next)) { // Ref date matchs with cron!...
-			for (nfield = 0; nfield <= field_name::year; nfield++)
-				if (!is_set(nfield)) { // searching for first not "*"
-					if (next) {
-						if (is_set(nfield, *tminfo[nfield] + (next ? 1 : -1) - (nfield == field_name::day_of_month))) { // previous on cron "* * * A-B(matching) * * * cmd"
-							set_field(nfield, false);
-							set_bit(nfield, *tminfo[nfield] + (next ? 1 : -1), true);
-						} else
-							*tminfo[nfield] += 1;
-						nfield = -2;
-					} else {
-						while (existing_field(--nfield))
-							*tminfo[nfield] = 0;
-						nfield = -3;
-						break;
-					} // previous on cron "* * * X(matching) * * * cmd"
-				}
-			if (nfield == -1)
-				return time_t(-1); // cron is "* * * * * * * cmd"
 		}
+		if (!z->covers(time_t(from))) // past the transitions loaded
+			return date_around(*localtime_r(&rawtime, &t), next);
+		return time_t(from);
 	}
-	return mktime(&result);
 }
 
 bool cron::split_string(std::string &first, std::string pattern, std::string &second) {
@@ -774,15 +894,6 @@ std::string &cron::trim_string(std::string &s) {
 	return s;
 }
 
-int cron::size_of_month(const std::tm &v, bool prev) {
-	static std::tm t;
-	t.tm_isdst = t.tm_wday = t.tm_yday = t.tm_sec = t.tm_min = t.tm_hour = 0;
-	t.tm_mday = 31;
-	t.tm_mon = v.tm_mon - prev;
-	t.tm_year = v.tm_year;
-	mktime(&t);
-	return (t.tm_mon == v.tm_mon ? 31 : (31 - t.tm_mday));
-}
 } //namespace crontab
 
 } // namespace datetime_utils
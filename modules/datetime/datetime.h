@@ -5,16 +5,20 @@
 
 #include <bitset>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
+#include "timezone.h"
+
 #define API_CALL
 #define API_CALL
 
@@ -128,15 +132,157 @@ enum field_name {
 }; // Adressage : field_name::hour
 
 static const byte field_size[] = { 60, 60, 24, 31, 12, 7, SCOPE_OF_YEARS * 2 + 1 }; // expr == sum ...
-static byte field_offset[] = { 0, 0, 0, 1, 1, 0, SCOPE_OF_YEARS };
+static const byte field_offset[] = { 0, 0, 0, 1, 1, 0, SCOPE_OF_YEARS };
+static const byte field_index[] = { 0, 60, 120, 144, 175, 187, 194 }; // first bit of the fields
 static const char *week_day[] = { "SUN", "MON", "TUE", "WED", "THU", "FRI", "SAT" };
 static const char *month_name[] = { "JAN", "FEB", "MAR", "APR", "MAY", "JUN", "JUL", "AUG", "SEP", "OCT", "NOV", "DEC" };
 static const byte npos = byte(-1);
 
+#define CRON_SPEC_YEAR 2000 /* first year of a cron_spec, which holds 128 */
+
+// Cron expression parsed at compile time, for the built-in schedules:
+//
+//   static constexpr cron_spec daily = "0 */15 9-17 * * mon,tue,thu,fri print"_cron;
+//
+// The grammar and the bits are the ones of cron::assign(). An invalid
+// literal does not compile (the parser throws in a constant expression).
+// Years are kept as such, and applied to the scope of years when turned
+// into a cron. Steps in the year field are not supported.
+struct cron_spec {
+	uint64_t bits[field_name::year]; // values of the fields up to the day of week, bit i for i + field_offset
+	uint64_t years[2]; // bit i for CRON_SPEC_YEAR + i
+	bool any_year, last;
+	const char *source, *command;
+
+	constexpr cron_spec(const char *s, size_t n) :
+			bits{}, years{}, any_year(false), last(false), source(s), command(nullptr) {
+		size_t p(skip(s, 0, n));
+		for (byte f(0); f < field_name::year; f++) {
+			const size_t e(token_end(s, p, n));
+			if (e == p || e == n)
+				throw std::invalid_argument("cron: missing field or command");
+			set_field(f, s, p, e);
+			p = skip(s, e, n);
+		}
+		const size_t e(token_end(s, p, n));
+		if (e == p)
+			throw std::invalid_argument("cron: missing command");
+		if (e == n) // no year
+			any_year = true;
+		else {
+			set_field(field_name::year, s, p, e);
+			p = skip(s, e, n);
+			if (p == n)
+				throw std::invalid_argument("cron: missing command");
+		}
+		for (byte f(0); f < field_name::year; f++)
+			if (!bits[f])
+				throw std::invalid_argument("cron: field with no value");
+		if (!any_year && !years[0] && !years[1])
+			throw std::invalid_argument("cron: no year");
+		command = s + p;
+	};
+
+	inline constexpr bool has_year(int y) const {
+		return any_year || (y >= CRON_SPEC_YEAR && y < CRON_SPEC_YEAR + 128 && (years[(y - CRON_SPEC_YEAR) / 64] >> ((y - CRON_SPEC_YEAR) % 64) & 1));
+	};
+
+private:
+	static constexpr size_t skip(const char *s, size_t p, size_t n) {
+		while (p < n && (s[p] == ' ' || s[p] == '\t'))
+			p++;
+		return p;
+	};
+	static constexpr size_t token_end(const char *s, size_t p, size_t n) {
+		while (p < n && s[p] != ' ' && s[p] != '\t')
+			p++;
+		return p;
+	};
+	static constexpr size_t find(const char *s, size_t p, size_t e, char c) {
+		while (p < e && s[p] != c)
+			p++;
+		return p;
+	};
+	static constexpr bool is(const char *s, size_t p, size_t e, const char *w, bool nocase = false) {
+		for (; p < e && *w; p++, w++)
+			if ((nocase && s[p] >= 'a' && s[p] <= 'z' ? s[p] - 'a' + 'A' : s[p]) != *w)
+				return false;
+		return p == e && !*w;
+	};
+	static constexpr int number(const char *s, size_t p, size_t e) {
+		if (p == e)
+			throw std::invalid_argument("cron: empty value");
+		int v(0);
+		for (; p < e; p++) {
+			if (s[p] < '0' || s[p] > '9' || v > 9999)
+				throw std::invalid_argument("cron: not a number");
+			v = v * 10 + (s[p] - '0');
+		}
+		return v;
+	};
+	// Number or name of a value, in the units of the field.
+	static constexpr int value(byte f, const char *s, size_t p, size_t e) {
+		const char *names(f == field_name::day_of_week ? "SUNMONTUEWEDTHUFRISAT" : f == field_name::month ? "JANFEBMARAPRMAYJUNJULAUGSEPOCTNOVDEC" : "");
+		for (int i(0); names[3 * i] && e - p == 3; i++) {
+			char name[4] = { names[3 * i], names[3 * i + 1], names[3 * i + 2], 0 };
+			if (is(s, p, e, name, true))
+				return i + field_offset[f];
+		}
+		return number(s, p, e);
+	};
+	constexpr void set(byte f, int v) {
+		if (f == field_name::year) {
+			if (v < CRON_SPEC_YEAR || v >= CRON_SPEC_YEAR + 128)
+				throw std::invalid_argument("cron: year out of range");
+			years[(v - CRON_SPEC_YEAR) / 64] |= uint64_t(1) << ((v - CRON_SPEC_YEAR) % 64);
+			return;
+		}
+		const int i(v - field_offset[f]);
+		if (i < 0 || i >= field_size[f])
+			throw std::invalid_argument("cron: value out of range");
+		bits[f] |= uint64_t(1) << i;
+	};
+	constexpr void set_field(byte f, const char *s, size_t p, size_t e) {
+		for (size_t c(find(s, p, e, ',')); p <= e; p = c + 1, c = find(s, p, e, ','))
+			set_item(f, s, p, c);
+	};
+	constexpr void set_item(byte f, const char *s, size_t p, size_t e) {
+		const size_t dash(find(s, p, e, '-')), slash(find(s, p, e, '/'));
+		if (dash < e) { // a-b
+			for (int v(value(f, s, p, dash)), b(value(f, s, dash + 1, e)); v <= b; v++)
+				set(f, v);
+		} else if (slash < e) { // a/step or */step, up to the last value of the field
+			const int step(number(s, slash + 1, e));
+			if (f == field_name::year || step == 0 || step > 196) // larger ones wrap around in cron::assign()
+				throw std::invalid_argument("cron: invalid step");
+			for (int v(is(s, p, slash, "*") ? field_offset[f] : value(f, s, p, slash)); v < field_size[f] + field_offset[f]; v += step)
+				set(f, v);
+		} else if (is(s, p, e, "*") || is(s, p, e, "?")) {
+			if (f == field_name::year)
+				any_year = true;
+			else
+				bits[f] = (uint64_t(2) << (field_size[f] - 1)) - 1;
+		} else if (is(s, p, e, "L")) {
+			if (f != field_name::day_of_week && f != field_name::day_of_month)
+				throw std::invalid_argument("cron: L is for days");
+			bits[f] |= uint64_t(1) << (field_size[f] - 1);
+			last = last || f == field_name::day_of_month;
+		} else if (is(s, p, e, "W")) {
+			if (f != field_name::day_of_week)
+				throw std::invalid_argument("cron: W is for the day of week");
+			bits[f] |= uint64_t(3) << (field_size[f] - 2);
+		} else
+			set(f, value(f, s, p, e));
+	};
+};
+
+inline constexpr cron_spec operator"" _cron(const char *s, size_t n) { return cron_spec(s, n); }
+
 API_CALL class cron : std::bitset<field_name::expr> {
 	bool _err, _last_is_set;
 	ushort _year;
 	std::string _expression;
+	uint64_t _mask[field_name::year + 1]; // values of the fields that fire, in std::tm units
 
 	cron(const std::tm *t) :
 			_err(false) {
@@ -145,15 +291,23 @@ API_CALL class cron : std::bitset<field_name::expr> {
 	};
 	inline void init(void) {
 		time_t rawtime(time(NULL));
-		_year = localtime(&rawtime)->tm_year;
+		std::tm now;
+		tzset(); // zone loaded here rather than by the first evaluation
+		_year = localtime_r(&rawtime, &now)->tm_year;
+		_last_is_set = false;
+		for (auto &m : _mask)
+			m = 0;
 	};
 
 	cron &assign(const std::tm *);
-	inline cron &assign(const time_t *t) { return assign(localtime(t)); };
+	inline cron &assign(const time_t *t) {
+		std::tm tm;
+		return assign(localtime_r(t, &tm));
+	};
 	inline cron &operator=(const std::tm *t) { return assign(t); };
 	inline cron &operator=(const time_t *t) { return assign(t); };
 
-	byte index(field_name const);
+	inline byte index(field_name const nfield) const { return field_index[nfield]; };
 	void set_field(field_name const, std::string, bool);
 	inline void set_field(byte const n, std::string s, bool v) { return (set_field(field_name(n), s, v)); };
 	inline void set_scope(field_name const nfield, bool v, byte begin, byte end, byte delta = 1) {
@@ -177,9 +331,9 @@ API_CALL class cron : std::bitset<field_name::expr> {
 	};
 	inline bool set_field(byte const nfield, bool v) { return (set_field(field_name(nfield), v)); };
 
-	inline bool is_set(field_name const nfield, byte i) { return ((existing_field(nfield) && i < field_size[nfield]) ? test(index(nfield) + i) : false); };
-	inline bool is_set(byte const nfield, byte i) { return (is_set(field_name(nfield), i - field_offset[nfield])); };
-	inline bool is_set(field_name const nfield) {
+	inline bool is_set(field_name const nfield, byte i) const { return ((existing_field(nfield) && i < field_size[nfield]) ? test(index(nfield) + i) : false); };
+	inline bool is_set(byte const nfield, byte i) const { return (is_set(field_name(nfield), i - field_offset[nfield])); };
+	inline bool is_set(field_name const nfield) const {
 		if (!existing_field(nfield))
 			return false;
 		for (byte i(0); i < field_size[nfield]; i++)
@@ -187,15 +341,15 @@ API_CALL class cron : std::bitset<field_name::expr> {
 				return false;
 		return true;
 	};
-	inline bool is_set(byte const nfield) { return (is_set(field_name(nfield))); };
-	inline bool is_not_set(field_name const nfield) {
+	inline bool is_set(byte const nfield) const { return (is_set(field_name(nfield))); };
+	inline bool is_not_set(field_name const nfield) const {
 		if (existing_field(nfield))
 			for (byte i(index(nfield)), j(i + field_size[nfield]); i < j; i++)
 				if (test(i))
 					return false;
 		return true;
 	};
-	inline byte find_bit(field_name const nfield, byte n = 0) {
+	inline byte find_bit(field_name const nfield, byte n = 0) const {
 		if (!existing_field(nfield))
 			return npos;
 		for (byte i(n); i < field_size[nfield]; i++)
@@ -203,15 +357,19 @@ API_CALL class cron : std::bitset<field_name::expr> {
 				return (i);
 		return npos;
 	};
-	inline byte find_bit(byte const nfield, byte n = 0) { return (find_bit(field_name(nfield) - field_offset[n], n)); };
-	inline bool existing_field(field_name const nfield) { return (nfield <= field_name::year); };
-	inline bool existing_field(byte const nfield) { return (nfield <= field_name::year); };
-	inline bool existing_bit(field_name const nfield, byte n) { return (existing_field(nfield) && n < field_size[nfield]); };
+	inline byte find_bit(byte const nfield, byte n = 0) const { return (find_bit(field_name(nfield) - field_offset[n], n)); };
+	inline bool existing_field(field_name const nfield) const { return (nfield <= field_name::year); };
+	inline bool existing_field(byte const nfield) const { return (nfield <= field_name::year); };
+	inline bool existing_bit(field_name const nfield, byte n) const { return (existing_field(nfield) && n < field_size[nfield]); };
 
 	inline void conv_error(bool b) { _err = b; };
-	inline bool conv_error(void) { return _err; };
+	inline bool conv_error(void) const { return _err; };
 
-	time_t date_around(const std::tm &, bool = true);
+	bool find_date(std::tm &, bool) const;
+	time_t date_around(const std::tm &, bool = true) const;
+	time_t date_around(const time_t &, bool = true) const;
+	void build_masks(void);
+	uint64_t days_of(int, int) const;
 
 	bool split_string(std::string &, std::string, std::string &);
 	inline bool is_numeric(std::string &s) {
@@ -228,30 +386,48 @@ API_CALL class cron : std::bitset<field_name::expr> {
 	std::string &trim_string(std::string &);
 	std::string &normalize_field(field_name const, std::string &);
 	inline std::string &normalize_field(byte const nfield, std::string &s) { return (normalize_field(field_name(nfield), s)); };
-	cron &init_ref(std::tm &, int *[]);
-	int size_of_month(const std::tm &, bool = false);
 
 public:
-	inline const std::string expression(void) { return _expression; };
-	inline const bool error(void) { return conv_error(); };
+	inline const std::string expression(void) const { return _expression; };
+	inline const bool error(void) const { return conv_error(); };
 
 	inline cron &clear(void) {
 		for (byte i(0); i < field_name::expr; i++)
 			set(i, false);
 		_expression.clear();
 		_last_is_set = false;
+		for (auto &m : _mask)
+			m = 0;
 		conv_error(true);
 		return *this;
 	};
 	cron &assign(std::string s);
 	inline cron &operator=(std::string s) { return assign(s); };
+	cron &assign(const cron_spec &);
+	inline cron &operator=(const cron_spec &s) { return assign(s); };
+
+	// Same fields and command.
+	inline bool operator==(const cron &o) const { return static_cast<const std::bitset<field_name::expr> &>(*this) == o && _last_is_set == o._last_is_set && _err == o._err && _expression == o._expression; };
+	inline bool operator!=(const cron &o) const { return !(*this == o); };
 
-	inline const time_t next_date(std::tm *t) { return date_around(*t); };
-	inline const time_t next_date(const time_t *rawtime) { return next_date(localtime(rawtime)); };
-	inline const time_t next_date(const time_t &rawtime) { return next_date(localtime(&rawtime)); };
-	inline const time_t previous_date(std::tm *t) { return date_around(*t, false); };
-	inline const time_t previous_date(const time_t *rawtime) { return previous_date(localtime(rawtime)); };
-	inline const time_t previous_date(const time_t &rawtime) { return previous_date(localtime(&rawtime)); };
+	// Thread safe: a parsed cron is only read.
+	inline const time_t next_date(const std::tm *t) const { return date_around(*t); };
+	inline const time_t next_date(const time_t *rawtime) const { return next_date(*rawtime); };
+	inline const time_t next_date(const time_t &rawtime) const { return date_around(rawtime); };
+	inline const time_t previous_date(const std::tm *t) const { return date_around(*t, false); };
+	inline const time_t previous_date(const time_t *rawtime) const { return previous_date(*rawtime); };
+	inline const time_t previous_date(const time_t &rawtime) const { return date_around(rawtime, false); };
+
+	// Jobs firing every hour run through the clock changes as they come;
+	// the others fire once (see date_around()).
+	inline bool every_hour(void) const { return _mask[field_name::hour_of_day] == (uint64_t(1) << 24) - 1; };
+
+	// True if the cron fires at that time (local).
+	bool matches(const std::tm &) const;
+	inline bool matches(const time_t &rawtime) const {
+		std::tm t;
+		return matches(*tz::local(rawtime, t));
+	};
 
 	cron(void) :
 			_err(false) { init(); };
@@ -260,6 +436,11 @@ public:
 		init();
 		assign(s);
 	};
+	cron(const cron_spec &s) :
+			_err(false) {
+		init();
+		assign(s);
+	};
 	~cron(void) { clear(); };
 };
 
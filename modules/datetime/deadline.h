@@ -0,0 +1,89 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+// Wait until an absolute time of the realtime clock, the way cron times
+// are: a timerfd armed with TFD_TIMER_ABSTIME, so the time spent between
+// two waits does not add up, and a wait across a suspend ends at the due
+// time (or at the resume, if it is past). With TFD_TIMER_CANCEL_ON_SET a
+// change of the clock ends the wait as well, for the schedule to be
+// looked at again.
+//
+// The descriptor goes in a poll() with the others of the thread. Where
+// there is no timerfd, fd() is -1 and poll_timeout() is the timeout.
+//
+// Reference:
+// ----------
+// https://man7.org/linux/man-pages/man2/timerfd_create.2.html
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+class deadline_timer {
+	int _fd = -1;
+	time_t _at = -1;
+
+public:
+	enum event_t {
+		none,
+		expired, // the time is reached
+		clock_set, // the clock was changed
+	};
+
+	bool open(void) {
+#ifdef __linux__
+		_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+		return _fd >= 0;
+	};
+
+	// Readable when consume() has something to report (-1 if no timerfd).
+	inline int fd(void) const { return _fd; };
+	inline time_t at(void) const { return _at; };
+
+	// Arms the timer for the time, -1 to disarm it. A time already past
+	// expires at once.
+	bool arm(time_t at) {
+		_at = at;
+#ifdef __linux__
+		if (_fd >= 0) {
+			struct itimerspec its = {};
+			its.it_value.tv_sec = at == time_t(-1) ? 0 : (at > 0 ? at : 1);
+			return timerfd_settime(_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, nullptr) == 0;
+		}
+#endif
+		return false;
+	};
+
+	// What woke the poll() up.
+	event_t consume(void) {
+		if (_fd < 0)
+			return (_at != time_t(-1) && time(nullptr) >= _at) ? expired : none;
+		uint64_t n;
+		const ssize_t r(read(_fd, &n, sizeof(n)));
+		if (r == ssize_t(sizeof(n)))
+			return expired;
+		return (r < 0 && errno == ECANCELED) ? clock_set : none;
+	};
+
+	// poll() timeout in ms: none with a timerfd (-1), else up to the time.
+	int poll_timeout(void) const {
+		if (_fd >= 0 || _at == time_t(-1))
+			return -1;
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		const long ms((_at - now.tv_sec) * 1000 - now.tv_nsec / 1000000);
+		return ms < 0 ? 0 : int(ms < 86400000L ? ms : 86400000L);
+	};
+
+	~deadline_timer() {
+		if (_fd >= 0)
+			close(_fd);
+	};
+};
+
+#endif // DEADLINE_H
@@ -0,0 +1,257 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+// Crontab scheduler: the entries are parsed once and kept in a min-heap
+// ordered by their next fire time. A wake-up only looks at the top of the
+// heap and reschedules the jobs that fired, so its cost does not depend
+// on the number of entries.
+//
+// Jobs are named, so a new version of the crontab can be applied in
+// place: only the entries added, removed or modified are parsed again.
+// Heap slots of replaced or removed jobs are dropped when they surface.
+//
+// Fires found more than MISSED_GRACE late (the machine was suspended, or
+// the clock set forward) follow the policy of their job: run once for
+// all of them, dropped, or each run in turn.
+
+#include "datetime.h"
+
+#include <ctime>
+#include <functional>
+#include <map>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace datetime_utils {
+
+namespace crontab {
+
+#define MISSED_GRACE 60 /* sec, later than that a fire was missed */
+#define MISSED_MAX 100 /* missed fires run per job and wake-up, with missed_all */
+#define CLOCK_SET_BACK 10800 /* sec, the clock set back further calls for restart() */
+
+typedef std::map<std::string, std::string> entries_t; // name -> crontab line
+typedef std::pair<const char *, cron_spec> builtin_t; // name, line parsed at compile time
+
+enum missed_t {
+	missed_once, // one run for the fires missed (default)
+	missed_skip, // none
+	missed_all, // a run for each of them
+};
+static const char *missed_name[] = { "once", "skip", "all" };
+typedef std::map<std::string, missed_t> policies_t; // job name -> policy
+
+inline bool missed_policy(const std::string &s, missed_t &p) {
+	for (int i(0); i <= missed_all; i++)
+		if (s == missed_name[i]) {
+			p = missed_t(i);
+			return true;
+		}
+	return false;
+}
+
+class scheduler {
+	struct job_t {
+		std::string name, line;
+		cron c;
+		unsigned gen;
+		bool active, queued;
+		missed_t missed;
+	};
+	struct fire_t {
+		time_t at;
+		size_t job;
+		unsigned gen;
+		bool operator>(const fire_t &o) const { return at > o.at || (at == o.at && job > o.job); }
+	};
+
+	std::vector<job_t> _jobs;
+	std::vector<size_t> _free;
+	std::map<std::string, size_t> _names;
+	std::priority_queue<fire_t, std::vector<fire_t>, std::greater<fire_t>> _timers;
+
+	inline bool live(const fire_t &t) const { return _jobs[t.job].active && _jobs[t.job].gen == t.gen; };
+	inline void prune(void) {
+		while (!_timers.empty() && !live(_timers.top()))
+			_timers.pop();
+	};
+	inline void compact(void) { // drops the dead slots when they outnumber the jobs
+		if (_timers.size() <= 2 * _names.size() + 16)
+			return;
+		std::vector<fire_t> slots;
+		for (; !_timers.empty(); _timers.pop())
+			if (live(_timers.top()))
+				slots.push_back(_timers.top());
+		_timers = decltype(_timers)(std::greater<fire_t>(), std::move(slots));
+	};
+	inline void schedule(size_t job, time_t after) {
+		const time_t at(_jobs[job].c.next_date(after));
+		_jobs[job].queued = (at != time_t(-1)); // else out of the scope of years
+		if (_jobs[job].queued)
+			_timers.push({ at, job, _jobs[job].gen });
+	};
+
+	inline static const std::string source(const std::string &line) { return line; };
+	inline static const std::string source(const cron_spec &spec) { return spec.source; };
+
+public:
+	static const size_t npos = size_t(-1);
+
+	// Schedules the first fire of the cron after now, replacing the job of
+	// the same name. Returns the job number, or npos if the cron is not
+	// valid (the previous job is kept then).
+	inline size_t add(const std::string &name, const std::string &line, const cron &c, time_t now) {
+		if (c.error())
+			return npos;
+		size_t n;
+		auto it(_names.find(name));
+		if (it != _names.end())
+			n = it->second;
+		else if (!_free.empty())
+			n = _free.back(), _free.pop_back();
+		else
+			n = _jobs.size(), _jobs.push_back({ "", "", cron(), 0, false, false, missed_once });
+		job_t &j(_jobs[n]);
+		if (it == _names.end())
+			j.missed = missed_once;
+		j.name = name, j.line = line, j.c = c;
+		j.gen++, j.active = true;
+		_names[name] = n;
+		schedule(n, now);
+		return n;
+	};
+	inline size_t add(const std::string &name, const std::string &line, time_t now) { return add(name, line, cron(line), now); };
+	inline size_t add(const std::string &name, const cron_spec &spec, time_t now) { return add(name, source(spec), cron(spec), now); };
+	inline size_t add(const std::string &line, time_t now) { return add(line, line, now); };
+
+	inline bool remove(const std::string &name) {
+		auto it(_names.find(name));
+		if (it == _names.end())
+			return false;
+		_jobs[it->second].active = false;
+		_jobs[it->second].gen++;
+		_free.push_back(it->second);
+		_names.erase(it);
+		return true;
+	};
+
+	// Applies a new version of the crontab (entries_t, or an array of
+	// builtin_t): new and modified entries are (re)scheduled after now,
+	// missing ones removed. Invalid lines are reported in rejected and
+	// leave the job as it was. Returns the number of jobs changed.
+	template <typename T>
+	inline size_t sync(const T &entries, time_t now, std::vector<std::string> *rejected = nullptr) {
+		size_t changes(0);
+		std::set<std::string> names;
+		for (const auto &e : entries)
+			names.insert(e.first);
+		std::vector<std::string> gone;
+		for (const auto &n : _names)
+			if (!names.count(n.first))
+				gone.push_back(n.first);
+		for (const std::string &name : gone)
+			changes += remove(name);
+		for (const auto &e : entries) {
+			auto it(_names.find(e.first));
+			if (it != _names.end() && _jobs[it->second].line == source(e.second))
+				continue;
+			if (add(e.first, e.second, now) == npos) {
+				if (rejected)
+					rejected->push_back(e.first);
+			} else
+				changes++;
+		}
+		compact();
+		return changes;
+	};
+
+	// Sets the policies of the jobs for missed fires, missed_once for the
+	// ones not listed.
+	inline void missed(const policies_t &policies) {
+		for (const auto &n : _names) {
+			auto it(policies.find(n.first));
+			_jobs[n.second].missed = it == policies.end() ? missed_once : it->second;
+		}
+	};
+
+	// Schedules all the jobs again after now, when the clock went back by
+	// more than CLOCK_SET_BACK: the fires up to the previous time are run
+	// again rather than waited for. Closer changes are left alone, as the
+	// fires in between already ran.
+	inline void restart(time_t now) {
+		for (const auto &n : _names) {
+			_jobs[n.second].gen++;
+			schedule(n.second, now);
+		}
+		compact();
+	};
+
+	inline const cron &job(size_t n) const { return _jobs[n].c; };
+	inline missed_t missed(size_t n) const { return _jobs[n].missed; };
+	inline const std::string &name(size_t n) const { return _jobs[n].name; };
+	inline size_t size(void) const { return _names.size(); };
+	inline bool empty(void) {
+		prune();
+		return _timers.empty();
+	};
+	inline size_t pending(void) const {
+		size_t n(0);
+		for (const auto &j : _names)
+			n += _jobs[j.second].queued;
+		return n;
+	};
+
+	// Next fire time, -1 if nothing is scheduled.
+	inline time_t next(void) {
+		prune();
+		return _timers.empty() ? time_t(-1) : _timers.top().at;
+	};
+	inline size_t next_job(void) {
+		prune();
+		return _timers.empty() ? npos : _timers.top().job;
+	};
+
+	// Calls f(job, at) for every job due at now, then reschedules them
+	// after now. Missed fires follow the policy of the job: missed_all
+	// ones are rescheduled after the fire instead, and run again until
+	// caught up (or MISSED_MAX). Returns the number of runs.
+	template <typename F>
+	size_t run(time_t now, F f) {
+		size_t runs(0);
+		std::map<size_t, unsigned> caught_up;
+		for (std::vector<fire_t> due;; due.clear()) {
+			for (prune(); !_timers.empty() && _timers.top().at <= now; prune()) {
+				due.push_back(_timers.top());
+				_jobs[due.back().job].queued = false;
+				_timers.pop();
+			}
+			if (due.empty())
+				return runs;
+			std::vector<time_t> after(due.size(), now);
+			for (size_t i(0); i < due.size(); i++) {
+				const fire_t &t(due[i]);
+				const missed_t policy(now - t.at > MISSED_GRACE ? _jobs[t.job].missed : missed_once);
+				if (policy == missed_all && ++caught_up[t.job] < MISSED_MAX)
+					after[i] = t.at;
+				if (policy != missed_skip)
+					f(t.job, t.at), runs++;
+			}
+			for (size_t i(0); i < due.size(); i++)
+				if (live(due[i])) // f may have changed the crontab
+					schedule(due[i].job, after[i]);
+		}
+	};
+
+	inline void clear(void) {
+		_jobs.clear(), _free.clear(), _names.clear();
+		_timers = decltype(_timers)();
+	};
+};
+
+} //namespace crontab
+
+} // namespace datetime_utils
+
+#endif // SCHEDULER_H
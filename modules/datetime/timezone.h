@@ -0,0 +1,411 @@
+#ifndef TIMEZONE_H
+#define TIMEZONE_H
+
+// Local time zone loaded from the TZif database once, so conversions
+// between UTC and local time are table lookups and calendar arithmetic
+// instead of a libc call consulting TZ each time. The zone is loaded
+// again when TZ or the zone file changes (looked at once a second).
+//
+// The transitions are taken from the file, then extended with the rule of
+// its footer (or of a POSIX TZ string) over the years cron can reach.
+// Out of that range, or when the zone cannot be read, covers() is false
+// and callers keep using localtime_r()/mktime().
+//
+// Reference:
+// ----------
+// https://www.rfc-editor.org/rfc/rfc8536 (TZif)
+// https://pubs.opengroup.org/onlinepubs/9699919799/basedefs/V1_chap08.html (TZ)
+// http://howardhinnant.github.io/date_algorithms.html
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace datetime_utils {
+
+namespace tz {
+
+/// CALENDAR
+
+inline int64_t days_from_civil(int64_t y, unsigned m, unsigned d) { // m 1..12
+	y -= m <= 2;
+	const int64_t era = (y >= 0 ? y : y - 399) / 400;
+	const unsigned yoe = unsigned(y - era * 400);
+	const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + int64_t(doe) - 719468;
+}
+
+inline void civil_from_days(int64_t z, int64_t &y, unsigned &m, unsigned &d) {
+	z += 719468;
+	const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+	const unsigned doe = unsigned(z - era * 146097);
+	const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	const unsigned mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y = int64_t(yoe) + era * 400 + (m <= 2);
+}
+
+inline int64_t floor_div(int64_t a, int64_t b) { return a / b - (a % b < 0); }
+
+// Local time as seconds since 1970-01-01 00:00 of the same calendar.
+inline int64_t local_seconds(const std::tm &t) {
+	return days_from_civil(1900 + int64_t(t.tm_year), t.tm_mon + 1, t.tm_mday) * 86400 + t.tm_hour * 3600 + t.tm_min * 60 + t.tm_sec;
+}
+
+inline void local_fields(int64_t s, std::tm &t) {
+	const int64_t days = floor_div(s, 86400), sec = s - days * 86400;
+	int64_t y;
+	unsigned m, d;
+	civil_from_days(days, y, m, d);
+	t.tm_year = int(y - 1900), t.tm_mon = int(m) - 1, t.tm_mday = int(d);
+	t.tm_hour = int(sec / 3600), t.tm_min = int(sec / 60 % 60), t.tm_sec = int(sec % 60);
+	t.tm_wday = int(floor_div(days + 4, 7) * -7 + days + 4); // 1970-01-01 was a Thursday
+	t.tm_yday = int(days - days_from_civil(y, 1, 1));
+}
+
+/// ZONE
+
+class zone {
+public:
+	struct type_t {
+		int32_t off; // seconds east of UTC
+		bool dst;
+		const char *abbr;
+	};
+	// Time span with one offset: [start, end), with the offsets on both sides.
+	struct segment_t {
+		int64_t start, end;
+		int32_t off, prev_off, next_off;
+	};
+
+	inline bool covers(time_t t) const { return _ok && t >= _since && t < _until; };
+
+	segment_t segment(time_t t) const {
+		const size_t i = std::upper_bound(_at.begin(), _at.end(), int64_t(t)) - _at.begin();
+		segment_t s;
+		s.start = i ? _at[i - 1] : INT64_MIN;
+		s.end = i < _at.size() ? _at[i] : INT64_MAX;
+		s.off = type(i).off;
+		s.prev_off = i ? type(i - 1).off : s.off;
+		s.next_off = i < _at.size() ? type(i + 1).off : s.off;
+		return s;
+	}
+
+	// localtime_r(), false when not covered.
+	bool to_local(time_t t, std::tm &tm) const {
+		if (!covers(t))
+			return false;
+		const type_t &ty = type(std::upper_bound(_at.begin(), _at.end(), int64_t(t)) - _at.begin());
+		local_fields(int64_t(t) + ty.off, tm);
+		tm.tm_isdst = ty.dst;
+#ifdef __USE_MISC
+		tm.tm_gmtoff = ty.off, tm.tm_zone = ty.abbr;
+#endif
+		return true;
+	}
+
+	// Zone of the process, loaded again when TZ or the zone file changed.
+	static std::shared_ptr<const zone> current() {
+		static std::mutex m;
+		static std::shared_ptr<const zone> zone_;
+		static std::atomic<time_t> checked(0);
+		const time_t now(time(nullptr));
+		if (checked.load(std::memory_order_relaxed) != now) {
+			std::lock_guard<std::mutex> lock(m);
+			if (checked.load(std::memory_order_relaxed) != now) {
+				std::shared_ptr<const zone> z(std::atomic_load(&zone_));
+				if (!z || z->stale())
+					std::atomic_store(&zone_, std::shared_ptr<const zone>(new zone(now)));
+				checked.store(now, std::memory_order_relaxed);
+			}
+		}
+		return std::atomic_load(&zone_);
+	}
+
+private:
+	std::vector<int64_t> _at; // transitions to _to[i]
+	std::vector<type_t> _to;
+	type_t _first = { 0, false, "UTC" }; // before the first transition
+	int64_t _since = INT64_MIN, _until = INT64_MAX;
+	bool _ok = false;
+	std::string _tz, _path; // what it was loaded from
+	struct stat _st = {};
+
+	const type_t &type(size_t i) const { return i ? _to[i - 1] : _first; } // in effect after i transitions
+
+	static const char *intern(const std::string &s) { // kept for tm_zone
+		static std::mutex m;
+		static std::set<std::string> names;
+		std::lock_guard<std::mutex> lock(m);
+		return names.insert(s).first->c_str();
+	}
+
+	bool stale() const {
+		const char *tz = getenv("TZ");
+		if ((tz ? tz : "\x01") != _tz)
+			return true;
+		struct stat st;
+		if (_path.empty())
+			return false;
+		if (stat(_path.c_str(), &st) != 0)
+			return _ok;
+		return st.st_ino != _st.st_ino || st.st_dev != _st.st_dev || st.st_mtime != _st.st_mtime || st.st_size != _st.st_size;
+	}
+
+	explicit zone(time_t now) {
+		const char *tz = getenv("TZ");
+		_tz = tz ? tz : "\x01"; // unset
+		std::string name(tz ? tz : "");
+		if (tz && !*tz) { // empty TZ is UTC
+			_ok = true;
+			return;
+		}
+		if (!name.empty() && name[0] == ':')
+			name.erase(0, 1);
+		if (!tz)
+			_path = "/etc/localtime";
+		else if (!name.empty() && name[0] == '/')
+			_path = name;
+		else if (name.find("..") == std::string::npos) {
+			const char *dir = getenv("TZDIR");
+			_path = std::string(dir ? dir : "/usr/share/zoneinfo") + "/" + name;
+		}
+		std::string rule;
+		if (!_path.empty() && stat(_path.c_str(), &_st) == 0 && load(_path, rule))
+			_ok = true;
+		else if (tz && (rule = name, true) && posix_rule(rule, _first, nullptr, nullptr, nullptr))
+			_path.clear(), _ok = true;
+		if (_ok && !rule.empty())
+			extend(rule, now);
+	}
+
+	static uint64_t be(const unsigned char *p, int n) {
+		uint64_t v = 0;
+		for (int i = 0; i < n; i++)
+			v = (v << 8) | p[i];
+		return v;
+	}
+
+	// Reads the transitions of a TZif file, and the footer rule of the
+	// version 2+ files.
+	bool load(const std::string &path, std::string &rule) {
+		std::ifstream f(path, std::ios::binary);
+		const std::vector<unsigned char> d((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+		size_t p = 0;
+		auto header = [&](uint32_t c[6]) {
+			if (d.size() < p + 44 || memcmp(&d[p], "TZif", 4) != 0)
+				return false;
+			for (int i = 0; i < 6; i++)
+				c[i] = uint32_t(be(&d[p + 20 + 4 * i], 4)); // isut, isstd, leap, time, type, char
+			p += 44;
+			return true;
+		};
+		uint32_t c[6];
+		if (!header(c))
+			return false;
+		const int v1 = d[4] < '2';
+		int size = 4;
+		if (!v1) { // skip the 32-bit data
+			p += c[3] * 5 + c[4] * 6 + c[5] + c[2] * 8 + c[1] + c[0];
+			if (!header(c))
+				return false;
+			size = 8;
+		}
+		if (c[2] != 0 || c[4] == 0 || d.size() < p + c[3] * (size + 1) + c[4] * 6 + c[5])
+			return false; // leap seconds are not handled
+		const size_t times = p, idx = times + c[3] * size, types = idx + c[3], chars = types + c[4] * 6;
+		std::vector<type_t> ty(c[4]);
+		for (uint32_t i = 0; i < c[4]; i++) {
+			const unsigned char *t = &d[types + i * 6];
+			ty[i].off = int32_t(uint32_t(be(t, 4)));
+			ty[i].dst = t[4] != 0;
+			const size_t a = t[5] < c[5] ? t[5] : 0;
+			ty[i].abbr = intern(std::string(reinterpret_cast<const char *>(&d[chars + a]), strnlen(reinterpret_cast<const char *>(&d[chars + a]), c[5] - a)));
+		}
+		_first = ty[0];
+		for (uint32_t i = 0; i < c[3]; i++) {
+			const uint64_t u = be(&d[times + i * size], size);
+			const int64_t at = size == 8 ? int64_t(u) : int64_t(int32_t(uint32_t(u)));
+			if (d[idx + i] >= c[4])
+				return false;
+			_at.push_back(at), _to.push_back(ty[d[idx + i]]);
+		}
+		p = chars + c[5] + c[2] * (size + 4) + c[1] + c[0];
+		if (!v1 && p < d.size() && d[p] == '\n') {
+			const size_t e = std::find(d.begin() + p + 1, d.end(), '\n') - d.begin();
+			rule.assign(d.begin() + p + 1, d.begin() + e);
+		}
+		return true;
+	}
+
+	// POSIX TZ rule: std offset [dst [offset] [,start[/time],end[/time]]].
+	// Gives the standard type, and the daylight one with its dates if any.
+	struct date_t {
+		char kind; // 'J' (1..365, no Feb 29), 'D' (0..365) or 'M'
+		int m, w, d, n;
+		int32_t time;
+	};
+	static bool posix_rule(const std::string &s, type_t &std_, type_t *dst, date_t *start, date_t *end) {
+		const char *p = s.c_str();
+		auto name = [&](std::string &n) {
+			const char *b = p;
+			if (*p == '<') {
+				for (b = ++p; *p && *p != '>'; p++)
+					;
+				if (*p != '>')
+					return false;
+				n.assign(b, p++);
+				return n.size() >= 3;
+			}
+			while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))
+				p++;
+			n.assign(b, p);
+			return n.size() >= 3;
+		};
+		auto number = [&](int &v) {
+			if (*p < '0' || *p > '9')
+				return false;
+			for (v = 0; *p >= '0' && *p <= '9'; p++)
+				v = v * 10 + (*p - '0');
+			return true;
+		};
+		auto hms = [&](int32_t &v) { // [+-]hh[:mm[:ss]]
+			const int sign = (*p == '-') ? -1 : 1;
+			if (*p == '-' || *p == '+')
+				p++;
+			int h, m = 0, sec = 0;
+			if (!number(h))
+				return false;
+			if (*p == ':' && (++p, !number(m)))
+				return false;
+			if (*p == ':' && (++p, !number(sec)))
+				return false;
+			v = sign * (h * 3600 + m * 60 + sec);
+			return true;
+		};
+		auto date = [&](date_t &r) {
+			r.time = 7200;
+			if (*p == 'M') {
+				p++, r.kind = 'M';
+				if (!number(r.m) || *p++ != '.' || !number(r.w) || *p++ != '.' || !number(r.d) || r.m < 1 || r.m > 12 || r.w < 1 || r.w > 5 || r.d > 6)
+					return false;
+			} else if (*p == 'J') {
+				p++, r.kind = 'J';
+				if (!number(r.n) || r.n < 1 || r.n > 365)
+					return false;
+			} else {
+				r.kind = 'D';
+				if (!number(r.n) || r.n > 365)
+					return false;
+			}
+			return *p != '/' || (++p, hms(r.time));
+		};
+		std::string n;
+		int32_t off, doff;
+		if (!name(n) || !hms(off))
+			return false;
+		std_ = { -off, false, intern(n) };
+		if (!*p)
+			return true;
+		if (!name(n))
+			return false;
+		doff = off - 3600;
+		if (*p && *p != ',' && !hms(doff))
+			return false;
+		date_t s1 = { 'M', 3, 2, 0, 0, 7200 }, s2 = { 'M', 11, 1, 0, 0, 7200 };
+		if (*p == ',' && (++p, !date(s1) || *p++ != ',' || !date(s2)))
+			return false;
+		if (*p)
+			return false;
+		if (dst)
+			*dst = { -doff, true, intern(n) }, *start = s1, *end = s2;
+		return true;
+	}
+
+	// Local day (days since the epoch) of the rule date in the year.
+	static int64_t rule_day(const date_t &r, int64_t y) {
+		const bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+		const int64_t jan1 = days_from_civil(y, 1, 1);
+		if (r.kind == 'J')
+			return jan1 + r.n - 1 + (leap && r.n >= 60);
+		if (r.kind == 'D')
+			return jan1 + r.n;
+		static const int mdays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+		const int64_t first = days_from_civil(y, r.m, 1);
+		const int wd1 = int((first % 7 + 11) % 7); // weekday of the 1st
+		int64_t day = first + (r.d - wd1 + 7) % 7 + 7 * (r.w - 1);
+		const int dim = mdays[r.m - 1] + (r.m == 2 && leap);
+		while (day >= first + dim)
+			day -= 7;
+		return day;
+	}
+
+	// Adds the transitions of the rule after the ones of the file, up to
+	// the last year a cron can fire (see SCOPE_OF_YEARS), plus a margin.
+	void extend(const std::string &rule, time_t now) {
+		type_t std_, dst = { 0, false, nullptr };
+		date_t start, end;
+		std::tm tm;
+		local_fields(int64_t(now), tm);
+		int64_t y0 = 1900 + tm.tm_year - 10, y1 = 1900 + tm.tm_year + 11;
+		if (!_at.empty()) { // from the last transition of the file
+			local_fields(_at.back(), tm);
+			y0 = std::min<int64_t>(y0, 1900 + tm.tm_year);
+		}
+		if (!posix_rule(rule, std_, &dst, &start, &end)) {
+			_until = _at.empty() ? INT64_MIN : _at.back() + 1; // the file only
+			return;
+		}
+		if (!dst.abbr) { // no daylight saving time (anymore)
+			if (_at.empty())
+				_first = std_;
+			else if (type(_at.size()).off != std_.off || type(_at.size()).dst)
+				_at.push_back(_at.back() + 1), _to.push_back(std_);
+			return;
+		}
+		const bool rule_only(_at.empty());
+		std::vector<std::pair<int64_t, type_t>> rules;
+		for (int64_t y = y0; y <= y1; y++) {
+			rules.push_back({ rule_day(start, y) * 86400 + start.time - std_.off, dst });
+			rules.push_back({ rule_day(end, y) * 86400 + end.time - dst.off, std_ });
+		}
+		std::sort(rules.begin(), rules.end(), [](const std::pair<int64_t, type_t> &a, const std::pair<int64_t, type_t> &b) { return a.first < b.first; });
+		for (const auto &r : rules)
+			if (_at.empty() || r.first > _at.back()) {
+				if (type(_at.size()).off == r.second.off && type(_at.size()).dst == r.second.dst)
+					continue;
+				_at.push_back(r.first), _to.push_back(r.second);
+			}
+		if (rule_only) // earlier years may have had other rules
+			_since = _at.front();
+		_until = days_from_civil(y1, 1, 1) * 86400;
+	}
+};
+
+// localtime_r() from the current zone when it covers the time.
+inline std::tm *local(const time_t &t, std::tm &tm) {
+	const std::shared_ptr<const zone> z(zone::current());
+	return (z && z->to_local(t, tm)) ? &tm : localtime_r(&t, &tm);
+}
+
+} // namespace tz
+
+} // namespace datetime_utils
+
+#endif // TIMEZONE_H
@@ -0,0 +1,158 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+// Control socket of a running instance: a UNIX stream socket taking one
+// command per connection, as a line of text, answered with one line.
+//
+// The socket is private to the user: it lives in $XDG_RUNTIME_DIR, or
+// else in a directory of its own under /tmp that only the user can
+// enter, and both ends check the user of the other one. A name squatted
+// by another user is refused, never trusted as "another instance".
+//
+// Reference:
+// ----------
+// https://man7.org/linux/man-pages/man7/unix.7.html
+// https://specifications.freedesktop.org/basedir-spec/latest/
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+
+#define CONTROL_NAME "words-memo.sock"
+#define CONTROL_TIMEOUT 1000 /* ms, for a client to send its command */
+
+// A directory of the user that nobody else can enter.
+static bool control_private(const std::string &dir) {
+	struct stat st;
+	return lstat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == geteuid() && (st.st_mode & 077) == 0;
+}
+
+// Path of the socket of the user's instance, empty if there is no
+// private directory for it (the /tmp one was made by someone else).
+static std::string control_path(void) {
+	const char *run = getenv("XDG_RUNTIME_DIR");
+	if (run && *run == '/' && control_private(run))
+		return std::string(run) + "/" CONTROL_NAME;
+	const std::string dir("/tmp/words-memo-" + std::to_string(geteuid()));
+	mkdir(dir.c_str(), 0700);
+	return control_private(dir) ? dir + "/" CONTROL_NAME : "";
+}
+
+// The other end of the connection runs as the same user (or root).
+static bool control_peer(int fd) {
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && (cred.uid == geteuid() || cred.uid == 0);
+#else
+	uid_t uid;
+	gid_t gid;
+	return getpeereid(fd, &uid, &gid) == 0 && (uid == geteuid() || uid == 0);
+#endif
+}
+
+static bool control_address(const std::string &path, struct sockaddr_un &addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(addr.sun_path))
+		return false;
+	memcpy(addr.sun_path, path.c_str(), path.size());
+	return true;
+}
+
+static bool control_line(int fd, std::string &line, int timeout) {
+	line.clear();
+	char c;
+	for (struct pollfd pfd = { fd, POLLIN, 0 }; line.size() < 256;) {
+		if (poll(&pfd, 1, timeout) <= 0)
+			return false;
+		const ssize_t n = read(fd, &c, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || c == '\n')
+			return n == 0 ? !line.empty() : true;
+		line += c;
+	}
+	return false;
+}
+
+// Sends the command to the running instance and reads the answer.
+// Returns false if there is no instance listening.
+static bool control_send(const std::string &path, const std::string &cmd, std::string *reply = nullptr) {
+	struct sockaddr_un addr;
+	if (!control_address(path, addr))
+		return false;
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	std::string line(cmd + "\n"), answer;
+	const bool ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && control_peer(fd) && send(fd, line.c_str(), line.size(), MSG_NOSIGNAL) == ssize_t(line.size()) && control_line(fd, answer, 10 * CONTROL_TIMEOUT);
+	close(fd);
+	if (ok && reply)
+		*reply = answer;
+	return ok;
+}
+
+struct control_server_t {
+	std::string path;
+	int fd = -1;
+
+	// Listens on the socket, unless another instance of the user already
+	// does. A socket file left by an instance that died is replaced.
+	bool open(const std::string &p) {
+		struct sockaddr_un addr;
+		if (!control_address(p, addr) || control_send(p, "status"))
+			return false;
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0)
+			return false;
+		unlink(p.c_str());
+		const bool ok = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && chmod(p.c_str(), 0600) == 0 && listen(fd, 8) == 0;
+		if (!ok) {
+			::close(fd);
+			fd = -1;
+			return false;
+		}
+		path = p;
+		return true;
+	}
+
+	// Waits up to the timeout (ms) for clients, and answers their
+	// commands with handler(command) -> reply. Returns false if not
+	// listening.
+	template <typename F>
+	bool serve(int timeout, F handler) {
+		if (fd < 0)
+			return false;
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, timeout) <= 0)
+			return true;
+		int client;
+		while ((client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC)) >= 0) {
+			std::string cmd;
+			if (control_peer(client) && control_line(client, cmd, CONTROL_TIMEOUT)) {
+				const std::string reply(handler(cmd) + "\n");
+				(void)!send(client, reply.c_str(), reply.size(), MSG_NOSIGNAL); // the client may be gone
+			}
+			::close(client);
+		}
+		return true;
+	}
+
+	void close() {
+		if (fd < 0)
+			return;
+		::close(fd);
+		unlink(path.c_str());
+		fd = -1;
+	}
+
+	~control_server_t() { close(); }
+};
+
+#endif // CONTROL_H
@@ -0,0 +1,162 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+// Bounded event queue between two threads, with a file descriptor based
+// wakeup (eventfd, pipe elsewhere) so consumers can sleep in poll/select
+// next to other descriptors.
+//
+// Reference:
+// ----------
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <atomic>
+#include <thread>
+
+// Multiple producers, single consumer ring. When the ring is full a
+// producer drops the oldest element, so the consumer always gets the
+// most recent events. If the consumer is reading that element, or
+// another producer is still writing it, the producer waits for it to be
+// done instead.
+template <typename T, size_t Size>
+class event_ring {
+	static_assert((Size & (Size - 1)) == 0, "ring size must be a power of two");
+
+	struct slot_t {
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+	slot_t slots[Size];
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+	std::atomic<size_t> dropped;
+	int rfd = -1, wfd = -1;
+
+	// Claims the oldest element.
+	bool take(T &v) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+		for (;;) {
+			slot_t &s = slots[pos & (Size - 1)];
+			const intptr_t dif = intptr_t(s.seq.load(std::memory_order_acquire)) - intptr_t(pos + 1);
+			if (dif == 0) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false; // empty
+			} else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+		slot_t &s = slots[pos & (Size - 1)];
+		v = std::move(s.data);
+		s.seq.store(pos + Size, std::memory_order_release);
+		return true;
+	}
+
+	// Drops the oldest element of a full ring, the one in the slot at
+	// pos, once it is written and unless the consumer has claimed it.
+	bool drop_oldest(size_t pos) {
+		size_t oldest = pos - Size;
+		slot_t &s = slots[pos & (Size - 1)];
+		if (s.seq.load(std::memory_order_acquire) != oldest + 1 || !tail.compare_exchange_strong(oldest, oldest + 1, std::memory_order_relaxed))
+			return false;
+		T old(std::move(s.data));
+		s.seq.store(pos, std::memory_order_release);
+		return true;
+	}
+
+public:
+	// Queues the event and wakes up the consumer. Returns false if
+	// an older event had to be dropped.
+	bool push(T v) {
+		size_t pos = head.load(std::memory_order_relaxed);
+		bool drop = false;
+		for (;;) {
+			slot_t &s = slots[pos & (Size - 1)];
+			const intptr_t dif = intptr_t(s.seq.load(std::memory_order_acquire)) - intptr_t(pos);
+			if (dif == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (dif < 0) { // full
+				if (drop_oldest(pos)) {
+					dropped.fetch_add(1, std::memory_order_relaxed);
+					drop = true;
+				} else
+					std::this_thread::yield(); // still being read or written, wait rather than drop a newer event
+				pos = head.load(std::memory_order_relaxed);
+			} else {
+				pos = head.load(std::memory_order_relaxed); // taken by another producer
+			}
+		}
+		slot_t &s = slots[pos & (Size - 1)];
+		s.data = std::move(v);
+		s.seq.store(pos + 1, std::memory_order_release);
+		wake();
+		return !drop;
+	}
+
+	bool pop(T &v) { return take(v); }
+
+	// Waits until an event is pushed, wake() is called or the timeout
+	// (in ms, -1 for none) expires.
+	bool wait(int timeout) {
+		struct pollfd pfd = { rfd, POLLIN, 0 };
+		const bool woken = (poll(&pfd, 1, timeout) > 0);
+		drain();
+		return woken;
+	}
+
+	void wake() {
+#ifdef __linux__
+		const uint64_t one = 1;
+		(void)!write(wfd, &one, sizeof(one));
+#else
+		const char one = 1;
+		(void)!write(wfd, &one, sizeof(one));
+#endif
+	}
+
+	// Clears pending wakeups - for consumers polling fd() themselves.
+	void drain() {
+		char buf[64];
+		while (read(rfd, buf, sizeof(buf)) > 0)
+			;
+	}
+
+	// Readable when events may be pending.
+	int fd() const { return rfd; }
+
+	size_t size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+	size_t drops() const { return dropped.load(std::memory_order_relaxed); }
+
+	event_ring() :
+			head(0), tail(0), dropped(0) {
+		for (size_t i = 0; i < Size; i++)
+			slots[i].seq.store(i, std::memory_order_relaxed);
+#ifdef __linux__
+		rfd = wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+		int fds[2];
+		if (pipe(fds) == 0) {
+			rfd = fds[0], wfd = fds[1];
+			fcntl(rfd, F_SETFL, O_NONBLOCK), fcntl(wfd, F_SETFL, O_NONBLOCK);
+		}
+#endif
+	}
+
+	~event_ring() {
+		if (wfd != rfd)
+			close(wfd);
+		close(rfd);
+	}
+};
+
+#endif // EVENTS_H
@@ -0,0 +1,196 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+// Speech synthesis backends.
+//
+// Reference:
+// ----------
+// https://github.com/espeak-ng/espeak-ng/blob/master/src/espeak-ng.1.ronn
+// http://soundfile.sapp.org/doc/WaveFormat/
+// http://www.mp3-tech.org/programmer/frame_header.html
+
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "gtts.h"
+#include "mp3.h"
+#include "../../par_easycurl.h"
+
+extern char **environ;
+
+// Cacheable backends write an mp3 sample which is kept in the cache and
+// played from there. The others speak straight to the output every time.
+// The language is an ISO 639-1 code (lang_codes), the speed a factor of
+// the normal one written as a decimal number ("1.0").
+struct tts_backend_t {
+	virtual ~tts_backend_t() {}
+	virtual const char *name() const = 0;
+	virtual std::string voice() const { return name(); } // part of the cache key
+	virtual bool cacheable() const = 0;
+
+	// Source of the sample, for logs and rate limiting (empty if local).
+	virtual std::string url(const std::string &text, const std::string &lang, const std::string &speed) const { return ""; }
+
+	// Writes the mp3 sample of the text to the file (cacheable backends).
+	virtual bool fetch(const std::string &text, const std::string &lang, const std::string &speed, const std::string &path, FILE *log) { return false; }
+
+	// Speaks the text to the output, or by itself when there is no output
+	// (backends which are not cacheable).
+	virtual bool speak(const std::string &text, const std::string &lang, const std::string &speed, pcm_sink_t *out, FILE *log) { return false; }
+};
+
+// Google Translate voice.
+struct google_backend_t : tts_backend_t {
+	const char *name() const { return "google"; }
+	bool cacheable() const { return true; }
+
+	std::string url(const std::string &text, const std::string &lang, const std::string &speed) const {
+		std::string q = text;
+		for (size_t i = 0; (i = q.find(' ', i)) != std::string::npos; i += 3)
+			q.replace(i, 1, "%20");
+		return _tts + q + _lang_opt + lang + _ttsspeed_opt + speed + _client;
+	}
+	bool fetch(const std::string &text, const std::string &lang, const std::string &speed, const std::string &path, FILE *log) {
+		const char *hdrs[] = { _ref.c_str(), _agent.c_str(), 0 };
+		return par_easycurl_to_file_ex(url(text, lang, speed).c_str(), path.c_str(), hdrs, log);
+	}
+};
+
+// Local synthesizer with the espeak command line (espeak-ng, espeak):
+// the WAV it writes on stdout is streamed to the output as it comes.
+struct command_backend_t : tts_backend_t {
+	std::string program;
+	int (*spawn)(const char *, char *const *);
+
+	const char *name() const { return program.c_str(); }
+	bool cacheable() const { return false; }
+
+	bool speak(const std::string &text, const std::string &lang, const std::string &speed, pcm_sink_t *out, FILE *log) {
+		const std::string wpm = std::to_string(lround(_words_per_minute * atof(speed.c_str())));
+		if (!out) { // plays by itself
+			char *const args[] = { const_cast<char *>(program.c_str()), const_cast<char *>("-v"), const_cast<char *>(lang.c_str()), const_cast<char *>("-s"), const_cast<char *>(wpm.c_str()), const_cast<char *>(text.c_str()), 0 };
+			return spawn(program.c_str(), args) == 0;
+		}
+		int fds[2];
+		if (pipe(fds) != 0)
+			return false;
+		char *const args[] = { const_cast<char *>(program.c_str()), const_cast<char *>("-v"), const_cast<char *>(lang.c_str()), const_cast<char *>("-s"), const_cast<char *>(wpm.c_str()), const_cast<char *>("--stdout"), const_cast<char *>(text.c_str()), 0 };
+		posix_spawn_file_actions_t action;
+		posix_spawn_file_actions_init(&action);
+		posix_spawn_file_actions_adddup2(&action, fds[1], STDOUT_FILENO);
+		posix_spawn_file_actions_addclose(&action, fds[0]);
+		pid_t pid;
+		const int rc = posix_spawnp(&pid, program.c_str(), &action, nullptr, args, environ);
+		posix_spawn_file_actions_destroy(&action);
+		close(fds[1]);
+		if (rc != 0) {
+			fprintf(log, "Running '%s' failed: %s.\n", program.c_str(), strerror(rc));
+			close(fds[0]);
+			return false;
+		}
+		const bool ok = stream(fds[0], out);
+		if (!ok)
+			kill(pid, SIGTERM);
+		close(fds[0]);
+		int status = 0;
+		waitpid(pid, &status, 0);
+		if (ok)
+			out->flush();
+		else {
+			out->abort();
+			if (!out->cancelled())
+				fprintf(log, "Speaking with '%s' on '%s' failed.\n", program.c_str(), out->name());
+		}
+		return ok;
+	}
+
+	command_backend_t(const std::string &prog, int (*proc)(const char *, char *const *)) :
+			program(prog), spawn(proc) {}
+
+private:
+	static const int _words_per_minute = 175; // espeak default, at speed 1.0
+
+	static bool read_all(int fd, void *buf, size_t n) {
+		char *p = static_cast<char *>(buf);
+		while (n > 0) {
+			const ssize_t r = read(fd, p, n);
+			if (r <= 0)
+				return false;
+			p += r, n -= r;
+		}
+		return true;
+	}
+	static uint32_t get(const unsigned char *p, int n) {
+		uint32_t v = 0;
+		for (int i = n - 1; i >= 0; i--)
+			v = (v << 8) | p[i];
+		return v;
+	}
+	// Walks the RIFF chunks up to the samples, which are passed on until
+	// the end of the stream (the data size is not known when streaming).
+	static bool stream(int fd, pcm_sink_t *out) {
+		unsigned char h[16];
+		if (!read_all(fd, h, 12) || memcmp(h, "RIFF", 4) != 0 || memcmp(h + 8, "WAVE", 4) != 0)
+			return false;
+		bool formatted = false;
+		while (read_all(fd, h, 8)) {
+			uint32_t size = get(h + 4, 4);
+			if (memcmp(h, "data", 4) == 0) {
+				if (!formatted)
+					return false;
+				char buf[4096];
+				ssize_t r;
+				while ((r = read(fd, buf, sizeof(buf))) > 0)
+					if (!out->write(buf, r))
+						return false;
+				return r == 0;
+			}
+			if (memcmp(h, "fmt ", 4) == 0 && size >= 16) {
+				if (!read_all(fd, h, 16) || get(h, 2) != 1 || get(h + 14, 2) != 16 || !out->format(get(h + 4, 4), get(h + 2, 2)))
+					return false;
+				formatted = true;
+				size -= 16;
+			}
+			for (char skip[256]; size > 0;) { // other chunks
+				const size_t n = size < sizeof(skip) ? size : sizeof(skip);
+				if (!read_all(fd, skip, n))
+					return false;
+				size -= n;
+			}
+		}
+		return false;
+	}
+};
+
+// Deterministic stand-in for tests and offline runs: silent mp3 frames,
+// as many as the text is long.
+struct fake_backend_t : tts_backend_t {
+	const char *name() const { return "fake"; }
+	bool cacheable() const { return true; }
+
+	bool fetch(const std::string &text, const std::string &lang, const std::string &speed, const std::string &path, FILE *log) {
+		FILE *f = fopen(path.c_str(), "wb");
+		if (!f)
+			return false;
+		// MPEG-1 layer III, 128 kbps, 44.1 kHz, mono: 417 bytes frames,
+		// all zero side info and main data decode to silence
+		unsigned char frame[417] = { 0xff, 0xfb, 0x90, 0xc4 };
+		bool ok = true;
+		for (size_t i = 0; i < 10 + 4 * text.size(); i++)
+			ok = ok && fwrite(frame, 1, sizeof(frame), f) == sizeof(frame);
+		return fclose(f) == 0 && ok;
+	}
+};
+
+#endif // BACKEND_H
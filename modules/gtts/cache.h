@@ -0,0 +1,504 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+// TTS samples cache.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mp3.h"
+
+/// KEYS
+
+static inline uint64_t murmur_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+static inline uint64_t murmur_fmix(uint64_t k) {
+	k ^= k >> 33, k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33, k *= 0xc4ceb9fe1a85ec53ULL;
+	return k ^ (k >> 33);
+}
+
+// MurmurHash3 x64 128-bit.
+// Reference: https://github.com/aappleby/smhasher/blob/master/src/MurmurHash3.cpp
+static inline void murmur3_128(const void *key, size_t len, uint64_t out[2], uint64_t seed = 0) {
+	const uint8_t *data = static_cast<const uint8_t *>(key);
+	const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = seed, h2 = seed, k1, k2;
+	for (size_t i = 0; i + 16 <= len; i += 16) {
+		memcpy(&k1, data + i, 8), memcpy(&k2, data + i + 8, 8);
+		k1 *= c1, k1 = murmur_rotl(k1, 31), k1 *= c2, h1 ^= k1;
+		h1 = murmur_rotl(h1, 27), h1 += h2, h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2, k2 = murmur_rotl(k2, 33), k2 *= c1, h2 ^= k2;
+		h2 = murmur_rotl(h2, 31), h2 += h1, h2 = h2 * 5 + 0x38495ab5;
+	}
+	const uint8_t *tail = data + (len & ~size_t(15));
+	k1 = k2 = 0;
+	for (int i = int(len & 15) - 1; i >= 8; i--)
+		k2 ^= uint64_t(tail[i]) << ((i - 8) * 8);
+	if ((len & 15) > 8)
+		k2 *= c2, k2 = murmur_rotl(k2, 33), k2 *= c1, h2 ^= k2;
+	for (int i = std::min(int(len & 15), 8) - 1; i >= 0; i--)
+		k1 ^= uint64_t(tail[i]) << (i * 8);
+	if (len & 15)
+		k1 *= c1, k1 = murmur_rotl(k1, 31), k1 *= c2, h1 ^= k1;
+	h1 ^= len, h2 ^= len;
+	h1 += h2, h2 += h1;
+	h1 = murmur_fmix(h1), h2 = murmur_fmix(h2);
+	h1 += h2, h2 += h1;
+	out[0] = h1, out[1] = h2;
+}
+
+// Content address of a sample: 128-bit hash of everything that changes
+// the audio, sharded in two directory levels ("3f/a2/3fa2...").
+static inline std::string cache_key(const std::string &text, const std::string &lang, const std::string &voice, const std::string &speed) {
+	const std::string id = text + '\0' + lang + '\0' + voice + '\0' + speed;
+	uint64_t h[2];
+	murmur3_128(id.data(), id.size(), h);
+	char hex[33];
+	snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)h[0], (unsigned long long)h[1]);
+	return std::string(hex, 2) + "/" + std::string(hex + 2, 2) + "/" + hex;
+}
+
+struct cache_file_t {
+	std::string key; // path in the cache
+	uint64_t size;
+	time_t used;
+};
+
+// Files with the given extension in the shards of the directory.
+static inline void cache_files(const std::string &dir, const std::string &ext, std::vector<cache_file_t> &files, const std::string &shard = "", int depth = 2) {
+	DIR *d = opendir((dir + "/" + shard).c_str());
+	if (!d)
+		return;
+	while (struct dirent *e = readdir(d)) {
+		const std::string name = e->d_name;
+		const std::string key = shard + name;
+		struct stat st;
+		if (name[0] == '.' || stat((dir + "/" + key).c_str(), &st) != 0)
+			continue;
+		if (depth > 0 && S_ISDIR(st.st_mode) && name.size() == 2)
+			cache_files(dir, ext, files, key + "/", depth - 1);
+		else if (depth == 0 && S_ISREG(st.st_mode) && name.size() > ext.size() && name.compare(name.size() - ext.size(), ext.size(), ext) == 0)
+			files.push_back({ key, uint64_t(st.st_size), st.st_mtime });
+	}
+	closedir(d);
+}
+
+/// INDEX
+
+// Index of a cache directory: size and last use of every entry, so
+// lookups never touch the entries themselves. It is kept in memory and
+// persisted as an append-only log, compacted when it grows too long,
+// and rebuilt from the directory when missing. Entries are evicted
+// least recently used first to fit the byte budget.
+//
+// Log records (keys have no spaces, the text runs to the end of line):
+//   + size used key text    added
+//   @ used key              used
+//   - key                   removed
+struct cache_index_t {
+	bool open(const std::string &path, const std::string &extension, uint64_t max_bytes, bool (*valid)(const std::string &) = nullptr) {
+		std::lock_guard<std::mutex> l(m);
+		dir = path, ext = extension, budget = max_bytes;
+		mkdir(dir.c_str(), 0755);
+		if (!load())
+			rebuild(valid);
+		purge_flat();
+		compact();
+		evict();
+		return log != nullptr;
+	}
+
+	// Valid entry lookup, marks the entry as used.
+	bool find(const std::string &key) {
+		std::lock_guard<std::mutex> l(m);
+		auto it = entries.find(key);
+		if (it == entries.end())
+			return false;
+		use(it, time(nullptr));
+		append("@ " + std::to_string(long(it->second.used)) + " " + key + "\n");
+		return true;
+	}
+
+	// Valid entry lookup with no side effects.
+	bool contains(const std::string &key) {
+		std::lock_guard<std::mutex> l(m);
+		return entries.count(key) != 0;
+	}
+
+	// Creates the shard directories of the entry.
+	void prepare(const std::string &key) {
+		for (size_t i = key.find('/'); i != std::string::npos; i = key.find('/', i + 1))
+			mkdir(path(key.substr(0, i)).c_str(), 0755);
+	}
+
+	// Registers an entry just written to the directory, with the text
+	// it was made from.
+	void insert(const std::string &key, uint64_t size, const std::string &text = "") {
+		std::lock_guard<std::mutex> l(m);
+		const time_t now = time(nullptr);
+		add(key, size, now, text);
+		append(record(key, entries[key]));
+		evict();
+	}
+
+	// Text of the entry.
+	std::string text(const std::string &key) {
+		std::lock_guard<std::mutex> l(m);
+		auto it = entries.find(key);
+		return it == entries.end() ? "" : it->second.text;
+	}
+
+	// Drops an entry and its file.
+	void erase(const std::string &key) {
+		std::lock_guard<std::mutex> l(m);
+		remove(key);
+	}
+
+	std::string path(const std::string &key) const { return dir + "/" + key; }
+	uint64_t bytes() {
+		std::lock_guard<std::mutex> l(m);
+		return total;
+	}
+	size_t size() {
+		std::lock_guard<std::mutex> l(m);
+		return entries.size();
+	}
+
+	~cache_index_t() {
+		if (log)
+			fclose(log);
+	}
+
+private:
+	struct entry_t {
+		uint64_t size;
+		time_t used;
+		std::string text;
+	};
+	typedef std::unordered_map<std::string, entry_t>::iterator iterator;
+
+	std::mutex m;
+	std::string dir, ext;
+	uint64_t budget = 0, total = 0;
+	std::unordered_map<std::string, entry_t> entries;
+	std::set<std::pair<time_t, std::string>> lru;
+	FILE *log = nullptr;
+	size_t records = 0;
+
+	std::string log_path() const { return dir + "/index.log"; }
+
+	void use(iterator it, time_t used) {
+		lru.erase({ it->second.used, it->first });
+		it->second.used = used;
+		lru.insert({ used, it->first });
+	}
+	void add(const std::string &key, uint64_t size, time_t used, const std::string &text) {
+		auto it = entries.find(key);
+		if (it != entries.end()) {
+			total -= it->second.size;
+			lru.erase({ it->second.used, key });
+		}
+		entries[key] = { size, used, text };
+		lru.insert({ used, key });
+		total += size;
+	}
+	void drop(const std::string &key) {
+		auto it = entries.find(key);
+		if (it == entries.end())
+			return;
+		total -= it->second.size;
+		lru.erase({ it->second.used, key });
+		entries.erase(it);
+	}
+	void remove(const std::string &key) {
+		unlink(path(key).c_str());
+		drop(key);
+		append("- " + key + "\n");
+	}
+	void evict() {
+		while (total > budget && !lru.empty())
+			remove(lru.begin()->second);
+	}
+
+	static std::string record(const std::string &key, const entry_t &e) {
+		return "+ " + std::to_string(e.size) + " " + std::to_string(long(e.used)) + " " + key + (e.text.empty() ? "" : " " + e.text) + "\n";
+	}
+
+	void append(const std::string &record) {
+		if (!log)
+			return;
+		fputs(record.c_str(), log);
+		fflush(log);
+		if (++records > 4 * entries.size() + 256)
+			compact();
+	}
+
+	bool load() {
+		FILE *f = fopen(log_path().c_str(), "r");
+		if (!f)
+			return false;
+		char *line = nullptr; // as long as the record, memo texts have no bound
+		size_t cap = 0;
+		while (getline(&line, &cap, f) > 0) {
+			line[strcspn(line, "\n")] = 0;
+			unsigned long long size;
+			long used;
+			int n = 0;
+			if (line[0] == '+' && sscanf(line, "+ %llu %ld %n", &size, &used, &n) == 2 && n > 0) {
+				char *text = strchr(line + n, ' ');
+				if (text)
+					*text++ = 0;
+				add(line + n, size, used, text ? text : "");
+			} else if (line[0] == '@' && sscanf(line, "@ %ld %n", &used, &n) == 1 && n > 0) {
+				auto it = entries.find(line + n);
+				if (it != entries.end())
+					use(it, used);
+			} else if (line[0] == '-' && line[1] == ' ')
+				drop(line + 2);
+		}
+		free(line);
+		fclose(f);
+		return true;
+	}
+
+	void rebuild(bool (*valid)(const std::string &)) {
+		std::vector<cache_file_t> files;
+		cache_files(dir, ext, files);
+		for (const cache_file_t &f : files) {
+			if (!valid || valid(path(f.key)))
+				add(f.key, f.size, f.used, "");
+			else
+				unlink(path(f.key).c_str());
+		}
+	}
+
+	// Deletes the entries of the flat layout used before the shards: they
+	// are never looked up again, and a rebuild does not see them.
+	void purge_flat() {
+		std::vector<cache_file_t> files;
+		cache_files(dir, ext, files, "", 0);
+		std::vector<std::string> keys;
+		for (const cache_file_t &f : files)
+			keys.push_back(f.key);
+		for (const auto &e : entries)
+			if (e.first.find('/') == std::string::npos)
+				keys.push_back(e.first);
+		for (const std::string &key : keys)
+			remove(key);
+	}
+
+	// Rewrites the log with one record per entry.
+	void compact() {
+		if (log)
+			fclose(log);
+		const std::string tmp = log_path() + ".tmp";
+		if (FILE *f = fopen(tmp.c_str(), "w")) {
+			for (const auto &e : entries)
+				fputs(record(e.first, e.second).c_str(), f);
+			if (fclose(f) == 0)
+				rename(tmp.c_str(), log_path().c_str());
+		}
+		log = fopen(log_path().c_str(), "a");
+		records = entries.size();
+	}
+};
+
+/// DECODED SAMPLES
+
+// Second tier for frequently replayed samples: the decoded PCM, played
+// straight from a mapping of the file with no decoding. A sample is
+// stored the second time it is played in a session, resampled to the
+// rate of the tier so replays never reconfigure the output, and the
+// tier is trimmed to its budget the same way as the samples one.
+struct pcm_cache_t {
+	cache_index_t index;
+	std::atomic<unsigned> hits, misses;
+	const long rate; // Hz, of every stored sample
+
+	// Plays the cached sample, false on a miss. A sample failing on the
+	// output side (or cancelled) still counts as played.
+	bool play(const std::string &clip, pcm_sink_t *sink) {
+		const std::string key = entry(clip);
+		if (!index.find(key)) {
+			misses++;
+			return false;
+		}
+		int fd = open(index.path(key).c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		void *p = MAP_FAILED;
+		if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > header_size)
+			p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (fd >= 0)
+			close(fd);
+		const unsigned char *h = static_cast<const unsigned char *>(p);
+		if (p == MAP_FAILED || memcmp(h, "PCM1", 4) != 0) {
+			if (p != MAP_FAILED)
+				munmap(p, st.st_size);
+			index.erase(key);
+			misses++;
+			return false;
+		}
+		if (sink->format(get(h + 4, 4), get(h + 8, 2)) && sink->write(h + header_size, st.st_size - header_size))
+			sink->flush();
+		else
+			sink->abort();
+		munmap(p, st.st_size);
+		hits++;
+		return true;
+	}
+
+	// Sink recording the clip on its way to the output, or null when the
+	// clip is not hot enough to be stored.
+	pcm_sink_t *record(const std::string &clip, pcm_sink_t *sink) {
+		if (!sink || played.insert(clip).second)
+			return nullptr;
+		recorder.start(this, entry(clip), sink);
+		return &recorder;
+	}
+
+	pcm_cache_t(const std::string &path, uint64_t max_bytes, long rate) :
+			hits(0), misses(0), rate(rate) {
+		index.open(path, ".pcm", max_bytes, &valid);
+	}
+
+private:
+	static const int header_size = 16; // "PCM1", rate, channels, padding
+
+	// Streaming linear interpolation of 16-bit frames from one rate to
+	// another. Positions are in input frames, counted in 1/to units so
+	// they stay exact: 0 is the last frame of the previous block, k + 1
+	// the frame k of this one.
+	struct resampler_t {
+		int channels = 0;
+		int64_t from = 0, to = 0, at = 0; // next output position
+		int16_t last[2];
+		std::vector<int16_t> out;
+
+		bool start(long f, long t, int c) {
+			if (c < 1 || c > 2 || f <= 0 || t <= 0)
+				return false;
+			channels = c, from = f, to = t;
+			at = to; // the first frame, nothing before it
+			return true;
+		}
+		// Converts a block of whole frames into out.
+		void convert(const int16_t *in, size_t frames) {
+			out.clear();
+			for (; at < int64_t(frames) * to; at += from) {
+				const int64_t i = at / to, frac = at % to;
+				for (int c = 0; c < channels; c++) {
+					const int a = i == 0 ? last[c] : in[(i - 1) * channels + c], b = in[i * channels + c];
+					out.push_back(int16_t(a + (b - a) * frac / to));
+				}
+			}
+			if (frames) {
+				for (int c = 0; c < channels; c++)
+					last[c] = in[(frames - 1) * channels + c];
+				at -= int64_t(frames) * to;
+			}
+		}
+	};
+
+	struct recorder_t : pcm_sink_t {
+		pcm_cache_t *cache = nullptr;
+		pcm_sink_t *out = nullptr;
+		std::string key, path;
+		FILE *f = nullptr;
+		resampler_t resampler;
+		bool same_rate = true;
+
+		void start(pcm_cache_t *c, const std::string &k, pcm_sink_t *o) {
+			discard();
+			cache = c, key = k, path = c->index.path(k), out = o;
+			c->index.prepare(k);
+			f = fopen((path + ".part").c_str(), "wb");
+		}
+		const char *name() const { return out->name(); }
+		bool format(long rate, int channels) {
+			if (f) {
+				unsigned char h[header_size] = { 'P', 'C', 'M', '1' };
+				put(h + 4, cache->rate, 4), put(h + 8, channels, 2);
+				same_rate = rate == cache->rate;
+				if (ftell(f) != 0 || (!same_rate && !resampler.start(rate, cache->rate, channels)) || fwrite(h, 1, header_size, f) != header_size)
+					discard(); // format change in the middle of a clip
+			}
+			return out->format(rate, channels);
+		}
+		bool write(const void *pcm, size_t n) {
+			if (f && same_rate) {
+				if (fwrite(pcm, 1, n, f) != n)
+					discard();
+			} else if (f) {
+				const size_t frame = 2 * resampler.channels;
+				resampler.convert(static_cast<const int16_t *>(pcm), n / frame);
+				const size_t bytes = resampler.out.size() * 2;
+				if (n % frame || fwrite(resampler.out.data(), 1, bytes, f) != bytes)
+					discard();
+			}
+			return out->write(pcm, n);
+		}
+		void flush() {
+			out->flush();
+			if (!f)
+				return;
+			const long size = ftell(f);
+			if (fclose(f) == 0 && size > header_size && rename((path + ".part").c_str(), path.c_str()) == 0)
+				cache->index.insert(key, size);
+			else
+				unlink((path + ".part").c_str());
+			f = nullptr;
+		}
+		void abort() {
+			out->abort();
+			discard();
+		}
+		bool cancelled() const { return out->cancelled(); }
+		void discard() {
+			if (!f)
+				return;
+			fclose(f);
+			unlink((path + ".part").c_str());
+			f = nullptr;
+		}
+	} recorder;
+
+	std::set<std::string> played;
+
+	// Decoded sample of the clip at the rate of the tier, in the same shard.
+	std::string entry(const std::string &clip) const { return clip.substr(0, clip.rfind('.')) + "-" + std::to_string(rate) + ".pcm"; }
+	static bool valid(const std::string &path) {
+		char magic[4] = { 0 };
+		if (FILE *f = fopen(path.c_str(), "rb")) {
+			(void)!fread(magic, 1, 4, f);
+			fclose(f);
+		}
+		return memcmp(magic, "PCM1", 4) == 0;
+	}
+	static void put(unsigned char *p, uint32_t v, int n) {
+		for (int i = 0; i < n; i++, v >>= 8)
+			p[i] = v & 0xff;
+	}
+	static uint32_t get(const unsigned char *p, int n) {
+		uint32_t v = 0;
+		for (int i = n - 1; i >= 0; i--)
+			v = (v << 8) | p[i];
+		return v;
+	}
+};
+
+#endif // CACHE_H
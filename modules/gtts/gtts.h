@@ -76,28 +76,25 @@ const std::map<std::string, std::string> lang_codes{
 	{ "cy", "Welsh" },
 };
 
-const std::string _curl = "curl ";
 const std::string _tts = "https://translate.google.com/translate_tts?ie=UTF-8&q=";
 const std::string _lang_opt = "&tl=";
+const std::string _ttsspeed_opt = "&ttsspeed=";
 const std::string _client = "&client=tw-ob";
-const std::string _out = " > /tmp/gtts.mp3";
-const std::string _outv = " > /tmp/gtts_";
 const std::string _ref = "Referer: http://translate.google.com/";
 const std::string _agent = "User-Agent: stagefright/1.2 (Linux;Android 9.0)";
 const std::string _mpv_cmd = "mpg321";
 const std::string _speed_opt = " --speed=";
-const std::string _play = " /tmp/gtts.mp3 1>/dev/null";
-const std::string _cat = "cat /tmp/gtts_*.mp3 > /tmp/gtts.mp3";
-const std::string _rm = "rm /tmp/gtts_*.mp3";
+const std::string _play = " - 1>/dev/null"; // from stdin
+const unsigned _fetch_workers = 4; // chunks downloaded at once
 
 class GoogleTTS {
-	std::vector<std::string> _cmds;
+	std::vector<std::string> _urls;
 
 	void parse(std::vector<std::string> &vec);
 	void parse();
 	std::vector<std::string> split(std::string &msg);
 	void replace(std::string &text);
-	void unite();
+	bool fetch(const std::string &url, std::string &mp3);
 
 	bool verbose = false;
 
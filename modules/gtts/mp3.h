@@ -1,3 +1,6 @@
+#ifndef MP3_H
+#define MP3_H
+
 // Reference:
 // ----------
 // https://lauri.võsandi.com/2013/12/implementing-mp3-player.en.html
@@ -7,29 +10,378 @@
 // https://alexvia.com/post/003_alsa_playback/
 // https://github.com/alsaplayer/alsaplayer/blob/master/output/alsa/alsa.c
 // https://github.com/LingYunZhi/madplay/blob/main/audio_alsa.c
+// https://www.mpg123.de/api/group__mpg123__lib.shtml
+// http://manuals.opensound.com/developer/
 
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/soundcard.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
 
 static const char *_cmd_player = "mpg321";
 static const char *_cmd_quiet = "-q";
 
+/// PCM OUTPUT
+
+// Receives signed 16-bit native endian samples. Outputs stay open
+// between clips and are only reconfigured when the format changes.
+struct pcm_sink_t {
+	virtual ~pcm_sink_t() {}
+	virtual const char *name() const = 0;
+	virtual bool format(long rate, int channels) = 0;
+	virtual bool write(const void *pcm, size_t bytes) = 0;
+	virtual void flush() {} // end of clip
+	virtual void abort() { flush(); } // end of a clip that failed to decode
+	virtual bool cancelled() const { return false; } // clip stopped on purpose
+};
+
+struct null_sink_t : pcm_sink_t {
+	size_t bytes = 0;
+
+	const char *name() const { return "null"; }
+	bool format(long rate, int channels) { return true; }
+	bool write(const void *pcm, size_t n) {
+		bytes += n;
+		return true;
+	}
+};
+
+#ifdef __linux__
+// OSS device, native or through the ALSA emulation.
+struct oss_sink_t : pcm_sink_t {
+	std::string device;
+	int fd = -1;
+	long rate = 0;
+	int channels = 0;
+
+	const char *name() const { return device.c_str(); }
+	bool format(long r, int c) {
+		if (fd >= 0 && r == rate && c == channels)
+			return true;
+		if (fd >= 0)
+			ioctl(fd, SNDCTL_DSP_SYNC, 0); // play out the previous clip
+		else if ((fd = ::open(device.c_str(), O_WRONLY | O_CLOEXEC)) < 0)
+			return false;
+		int fmt = AFMT_S16_NE, ch = c, speed = int(r);
+		if (ioctl(fd, SNDCTL_DSP_SETFMT, &fmt) < 0 || ioctl(fd, SNDCTL_DSP_CHANNELS, &ch) < 0 || ioctl(fd, SNDCTL_DSP_SPEED, &speed) < 0) {
+			::close(fd);
+			fd = -1;
+			return false;
+		}
+		rate = r, channels = c;
+		return true;
+	}
+	bool write(const void *pcm, size_t n) {
+		const char *p = static_cast<const char *>(pcm);
+		while (n > 0) {
+			ssize_t w = ::write(fd, p, n);
+			if (w < 0)
+				return false;
+			p += w, n -= w;
+		}
+		return true;
+	}
+	// Drops the audio still buffered in the device, so a cancelled clip
+	// stops at once. The format is set again at the next clip.
+	void abort() {
+		if (fd >= 0)
+			ioctl(fd, SNDCTL_DSP_RESET, 0);
+		rate = 0, channels = 0;
+	}
+
+	oss_sink_t(const std::string &dev = "/dev/dsp") :
+			device(dev) {}
+	~oss_sink_t() {
+		if (fd >= 0)
+			::close(fd);
+	}
+};
+#endif
+
+// RIFF/WAVE file, rewritten for every clip.
+struct wav_sink_t : pcm_sink_t {
+	std::string path;
+	FILE *f = nullptr;
+	long rate = 0;
+	int channels = 0;
+	uint32_t bytes = 0;
+
+	const char *name() const { return path.c_str(); }
+	bool format(long r, int c) {
+		if (f && r == rate && c == channels)
+			return true;
+		flush();
+		if (!(f = fopen(path.c_str(), "wb")))
+			return false;
+		rate = r, channels = c, bytes = 0;
+		header();
+		return true;
+	}
+	bool write(const void *pcm, size_t n) {
+		if (!f || fwrite(pcm, 1, n, f) != n)
+			return false;
+		bytes += n;
+		return true;
+	}
+	void flush() {
+		if (!f)
+			return;
+		fseek(f, 0, SEEK_SET);
+		header();
+		fclose(f);
+		f = nullptr;
+	}
+
+	wav_sink_t(const std::string &p) :
+			path(p) {}
+	~wav_sink_t() { flush(); }
+
+private:
+	void put(uint32_t v, int n) {
+		for (int i = 0; i < n; i++, v >>= 8)
+			fputc(v & 0xff, f);
+	}
+	void header() {
+		fwrite("RIFF", 1, 4, f), put(36 + bytes, 4), fwrite("WAVEfmt ", 1, 8, f);
+		put(16, 4), put(1, 2), put(channels, 2), put(rate, 4);
+		put(rate * channels * 2, 4), put(channels * 2, 2), put(16, 2);
+		fwrite("data", 1, 4, f), put(bytes, 4);
+	}
+};
+
+// Front of an output that can stop a clip midway: samples are passed in
+// small blocks and refused once the clip is cancelled. Also notes when
+// the first sample of the clip went out.
+struct gate_sink_t : pcm_sink_t {
+	pcm_sink_t *out = nullptr;
+	std::atomic<bool> stop;
+	std::atomic<bool> started;
+	std::chrono::steady_clock::time_point first;
+
+	void arm() { stop = false, started = false; } // next clip
+	void cancel() { stop = true; }
+
+	const char *name() const { return out->name(); }
+	bool format(long rate, int channels) { return !stop && out->format(rate, channels); }
+	bool write(const void *pcm, size_t n) {
+		const char *p = static_cast<const char *>(pcm);
+		for (size_t k; n > 0; p += k, n -= k) {
+			if (stop)
+				return false;
+			k = n < block ? n : size_t(block);
+			if (!started) {
+				first = std::chrono::steady_clock::now();
+				started = true;
+			}
+			if (!out->write(p, k))
+				return false;
+		}
+		return true;
+	}
+	void flush() { out->flush(); }
+	void abort() { out->abort(); }
+	bool cancelled() const { return stop; }
+
+	gate_sink_t(pcm_sink_t *o = nullptr) :
+			out(o), stop(false), started(false) {}
+
+private:
+	enum { block = 4096 };
+};
+
+/// MP3 DECODING
+
+// libmpg123 is loaded at runtime: there is no build dependency, and the
+// player falls back to spawning mpg321 where the library is missing.
+struct mpg123_api_t {
+	enum {
+		MPG123_OK = 0,
+		MPG123_ERR = -1,
+		MPG123_NEED_MORE = -10,
+		MPG123_NEW_FORMAT = -11,
+		MPG123_DONE = -12,
+		MPG123_MONO = 1,
+		MPG123_STEREO = 2,
+		MPG123_ENC_SIGNED_16 = 0xd0,
+	};
+
+	void *lib = nullptr;
+	int (*init)(void);
+	void *(*create)(const char *, int *);
+	void (*destroy)(void *);
+	int (*format_none)(void *);
+	int (*format)(void *, long, int, int);
+	void (*rates)(const long **, size_t *);
+	int (*open_feed)(void *);
+	int (*decode)(void *, const unsigned char *, size_t, unsigned char *, size_t, size_t *);
+	int (*getformat)(void *, long *, int *, int *);
+	int (*close)(void *);
+
+	bool load() {
+		if (lib)
+			return true;
+		for (const char *name : { "libmpg123.so.0", "libmpg123.so", "libmpg123.0.dylib", "libmpg123.dylib" })
+			if ((lib = dlopen(name, RTLD_NOW | RTLD_LOCAL)))
+				break;
+		if (!lib)
+			return false;
+		bool ok = true;
+		auto sym = [&](const char *name) {
+			void *p = dlsym(lib, name);
+			ok = ok && p;
+			return p;
+		};
+		*(void **)&init = sym("mpg123_init");
+		*(void **)&create = sym("mpg123_new");
+		*(void **)&destroy = sym("mpg123_delete");
+		*(void **)&format_none = sym("mpg123_format_none");
+		*(void **)&format = sym("mpg123_format");
+		*(void **)&rates = sym("mpg123_rates");
+		*(void **)&open_feed = sym("mpg123_open_feed");
+		*(void **)&decode = sym("mpg123_decode");
+		*(void **)&getformat = sym("mpg123_getformat");
+		*(void **)&close = sym("mpg123_close");
+		if (!ok || init() != MPG123_OK) {
+			dlclose(lib);
+			lib = nullptr;
+		}
+		return lib != nullptr;
+	}
+};
+
+// Streaming decoder: feed() accepts the mp3 in pieces of any size and
+// writes the PCM out as soon as frames are complete.
+struct mp3_decoder_t {
+	mpg123_api_t api;
+	void *handle = nullptr;
+	pcm_sink_t *sink = nullptr;
+	size_t written = 0; // bytes of PCM given to the sink since begin()
+
+	bool ready() const { return handle != nullptr; }
+
+	bool begin(pcm_sink_t *out) {
+		sink = out;
+		written = 0;
+		return handle && api.open_feed(handle) == mpg123_api_t::MPG123_OK;
+	}
+	bool feed(const void *data, size_t n) {
+		unsigned char pcm[16384];
+		size_t done = 0;
+		int rc = api.decode(handle, static_cast<const unsigned char *>(data), n, pcm, sizeof(pcm), &done);
+		while (true) {
+			if (rc == mpg123_api_t::MPG123_NEW_FORMAT) {
+				long rate;
+				int channels, enc;
+				api.getformat(handle, &rate, &channels, &enc);
+				if (!sink->format(rate, channels))
+					return false;
+			}
+			if (done > 0 && !sink->write(pcm, done))
+				return false;
+			written += done;
+			if (rc != mpg123_api_t::MPG123_OK && rc != mpg123_api_t::MPG123_NEW_FORMAT)
+				break;
+			rc = api.decode(handle, nullptr, 0, pcm, sizeof(pcm), &done);
+		}
+		return rc != mpg123_api_t::MPG123_ERR;
+	}
+	void end() { api.close(handle); }
+
+	mp3_decoder_t() {
+		if (!api.load() || !(handle = api.create(nullptr, nullptr)))
+			return;
+		const long *list;
+		size_t n;
+		api.rates(&list, &n);
+		api.format_none(handle);
+		for (size_t i = 0; i < n; i++)
+			api.format(handle, list[i], mpg123_api_t::MPG123_MONO | mpg123_api_t::MPG123_STEREO, mpg123_api_t::MPG123_ENC_SIGNED_16);
+	}
+	~mp3_decoder_t() {
+		if (handle)
+			api.destroy(handle);
+	}
+};
+
+/// PLAYER
+
 struct mad_player_t {
 	FILE *log;
 	bool quiet = false;
 
 	int (*spawn)(const char *, char *const *);
 
-	void play(const char *filename) {
+	mp3_decoder_t decoder;
+	pcm_sink_t *sink;
+
+	// Plays to the given sink (the player one if null), or with the
+	// external player when the file cannot be decoded in-process. Once
+	// some audio went out, a failure stops the clip: replaying it from
+	// the start would play that part twice.
+	void play(const char *filename, pcm_sink_t *out = nullptr) {
+		if (!out)
+			out = sink;
+		if (out && decoder.ready()) {
+			decoder.written = 0;
+			if (decode(filename, out) || out->cancelled())
+				return;
+			if (decoder.written) {
+				fprintf(log, "Stopped '%s' after %zu bytes, not replayed with '%s'.\n", filename, decoder.written, _cmd_player);
+				return;
+			}
+		}
 		char *const args1[] = { const_cast<char *>(_cmd_player), const_cast<char *>(filename), 0 };
 		char *const args2[] = { const_cast<char *>(_cmd_player), const_cast<char *>(_cmd_quiet), const_cast<char *>(filename), 0 };
 		spawn(_cmd_player, quiet ? args2 : args1);
 	}
 
-	mad_player_t(int (*proc)(const char *, char *const *), FILE *f = stderr) :
-			log(f), spawn(proc) {
-		fprintf(f, "Player created (with '%s', quiet=%d).\n", _cmd_player, quiet);
+	mad_player_t(int (*proc)(const char *, char *const *), FILE *f = stderr, pcm_sink_t *out = nullptr) :
+			log(f), spawn(proc), sink(out) {
+		if (sink && decoder.ready())
+			fprintf(f, "Player created (in-process, output '%s').\n", sink->name());
+		else
+			fprintf(f, "Player created (with '%s', quiet=%d).\n", _cmd_player, quiet);
 	}
 
 	~mad_player_t() {
 	}
+
+private:
+	bool decode(const char *filename, pcm_sink_t *out) {
+		std::vector<unsigned char> mp3;
+		if (FILE *fp = fopen(filename, "rb")) {
+			unsigned char buf[8192];
+			size_t n;
+			while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+				mp3.insert(mp3.end(), buf, buf + n);
+			fclose(fp);
+		}
+		if (mp3.empty() || !decoder.begin(out)) {
+			out->abort();
+			return false;
+		}
+		const bool ok = decoder.feed(mp3.data(), mp3.size());
+		decoder.end();
+		if (ok)
+			out->flush();
+		else {
+			out->abort();
+			if (!out->cancelled())
+				fprintf(log, "Playing '%s' on '%s' failed.\n", filename, out->name());
+		}
+		return ok;
+	}
 };
+
+#endif // MP3_H
@@ -0,0 +1,128 @@
+#ifndef ESCPOS_H
+#define ESCPOS_H
+
+// ESC/POS print jobs for the thermal printer. A job is built in a fixed
+// buffer, then handed to the printer daemon with a single write() on a
+// descriptor kept open, so the daemon reads it in one piece. The buffer
+// is PIPE_BUF long, the most a write to a FIFO delivers at once: a job
+// that does not fit is refused rather than cut.
+//
+// Reference:
+// ----------
+// https://reference.epson-biz.com/modules/ref_escpos/
+// https://man7.org/linux/man-pages/man7/pipe.7.html
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#define PRINTER_PATH "/tmp/DEVTERM_PRINTER_IN"
+#define PRINT_JOB_SIZE PIPE_BUF
+#define PRINT_TIMEOUT 2000 /* ms, for the daemon to make room in the FIFO */
+
+class print_job {
+	char _buf[PRINT_JOB_SIZE];
+	size_t _size = 0, _wanted = 0;
+
+public:
+	print_job &raw(const void *data, size_t n) {
+		if (_wanted == _size && n <= sizeof(_buf) - _size) {
+			memcpy(_buf + _size, data, n);
+			_size += n;
+		}
+		_wanted += n;
+		return *this;
+	};
+	inline print_job &text(const std::string &s) { return raw(s.data(), s.size()); };
+	inline print_job &feed(int lines) { return raw("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n", lines < 16 ? lines : 16); };
+
+	// ESC ! n - print mode (0: font A, 1: font B)
+	inline print_job &mode(uint8_t n) {
+		const uint8_t cmd[] = { 0x1b, 0x21, n };
+		return raw(cmd, sizeof(cmd));
+	};
+	// GS ! n - character size
+	inline print_job &size(uint8_t n) {
+		const uint8_t cmd[] = { 0x1d, 0x21, n };
+		return raw(cmd, sizeof(cmd));
+	};
+	// GS v 0 - raster bit image, width in bytes, one bit per dot
+	inline print_job &raster(const uint8_t *pixels, int width, int height) {
+		const uint8_t cmd[] = { 0x1d, 0x76, 0x30, 0, uint8_t(width), uint8_t(width >> 8), uint8_t(height), uint8_t(height >> 8) };
+		return raw(cmd, sizeof(cmd)).raw(pixels, size_t(width) * height);
+	};
+
+	inline bool fits(void) const { return _wanted == _size; };
+	inline size_t wanted(void) const { return _wanted; }; // bytes the job needs
+	inline const char *data(void) const { return _buf; };
+	inline size_t length(void) const { return _size; };
+	inline void clear(void) { _size = _wanted = 0; };
+};
+
+// The printer daemon input, opened at the first job and kept open. It is
+// opened again when the daemon went away and came back.
+class printer_t {
+	std::string _path;
+	int _fd = -1;
+
+	// One write(), waiting up to PRINT_TIMEOUT if the FIFO is full. The
+	// SIGPIPE of a daemon gone is held and consumed rather than fatal.
+	int write_job(const print_job &job) {
+		sigset_t pipe_set, old;
+		sigemptyset(&pipe_set);
+		sigaddset(&pipe_set, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
+		struct pollfd pfd = { _fd, POLLOUT, 0 };
+		ssize_t n;
+		while ((n = write(_fd, job.data(), job.length())) < 0 && (errno == EINTR || (errno == EAGAIN && poll(&pfd, 1, PRINT_TIMEOUT) > 0)))
+			;
+		const int err(n < 0 ? errno : (size_t(n) == job.length() ? 0 : EIO));
+		if (err == EPIPE) {
+			const struct timespec now = { 0, 0 };
+			sigtimedwait(&pipe_set, nullptr, &now);
+		}
+		pthread_sigmask(SIG_SETMASK, &old, nullptr);
+		return err;
+	};
+
+public:
+	explicit printer_t(const std::string &path = PRINTER_PATH) :
+			_path(path) {}
+
+	inline const std::string &path(void) const { return _path; };
+
+	// Sends the job. Returns 0, or the errno of the failure: ENXIO when no
+	// daemon reads the FIFO, EAGAIN when it stays full, EMSGSIZE when the
+	// job did not fit in its buffer.
+	int submit(const print_job &job) {
+		if (!job.fits())
+			return EMSGSIZE;
+		for (int attempt(0); attempt < 2; attempt++) {
+			if (_fd < 0 && (_fd = ::open(_path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+				return errno;
+			const int err(write_job(job));
+			if (err != EPIPE)
+				return err;
+			close(); // the daemon was restarted: once more on a new descriptor
+		}
+		return EPIPE;
+	};
+
+	void close(void) {
+		if (_fd >= 0)
+			::close(_fd);
+		_fd = -1;
+	};
+
+	~printer_t() { close(); };
+};
+
+#endif // ESCPOS_H
@@ -22,16 +22,40 @@ typedef unsigned char par_byte;
 // currently unused, so you can just pass 0.
 void par_easycurl_init(unsigned int flags);
 
+// Releases what par_easycurl_init set up, once no transfer is running.
+void par_easycurl_shutdown();
+
 // Allocates a memory buffer and downloads a data blob into it.
 // Returns 1 for success and 0 otherwise.  The byte count should be
 // pre-allocated.  The caller is responsible for freeing the returned data.
 // This does not do any caching!
 int par_easycurl_to_memory(char const* url, par_byte** data, int* nbytes);
 
+// Same as par_easycurl_to_memory, with extra request headers (null
+// terminated list, can be null) and a log stream for errors (stderr if null).
+int par_easycurl_to_memory_ex(char const* url, par_byte** data, int* nbytes, const char **hdrs, FILE *f);
+
 // Downloads a file from the given URL and saves it to disk.  Returns 1 for
-// success and 0 otherwise.
+// success and 0 otherwise.  Partial files are removed on failure.
 int par_easycurl_to_file(char const* srcurl, char const* dstpath);
 
+// Same as par_easycurl_to_file, with extra request headers (null terminated
+// list, can be null) and a log stream for errors (stderr if null).
+int par_easycurl_to_file_ex(char const* srcurl, char const* dstpath, const char **hdrs, FILE *f);
+
+// Timings of the last transfer made by the calling thread, successful
+// or not.  Times are in seconds, speed in bytes per second.
+typedef struct {
+    long status;
+    long long bytes;
+    long long speed;
+    double connect_time;
+    double first_byte_time;
+    double total_time;
+} par_easycurl_stats;
+
+par_easycurl_stats par_easycurl_last_stats();
+
 #ifdef __cplusplus
 }
 #endif
@@ -44,6 +68,7 @@ int par_easycurl_to_file(char const* srcurl, char const* dstpath);
 
 #ifdef PAR_EASYCURL_IMPLEMENTATION
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -58,6 +83,34 @@ int par_easycurl_to_file(char const* srcurl, char const* dstpath);
 
 static int _ready = 0, _verbose = 0;
 
+#ifdef __cplusplus
+static thread_local par_easycurl_stats _stats;
+#else
+static _Thread_local par_easycurl_stats _stats;
+#endif
+
+par_easycurl_stats par_easycurl_last_stats()
+{
+    return _stats;
+}
+
+// Collects the transfer statistics and releases the handle.
+static long par_easycurl_finish(CURL* handle)
+{
+    curl_off_t bytes = 0, speed = 0;
+    memset(&_stats, 0, sizeof(_stats));
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &_stats.status);
+    curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    curl_easy_getinfo(handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+    curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME, &_stats.connect_time);
+    curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME, &_stats.first_byte_time);
+    curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &_stats.total_time);
+    curl_easy_cleanup(handle);
+    _stats.bytes = bytes;
+    _stats.speed = speed;
+    return _stats.status;
+}
+
 void par_easycurl_init(unsigned int flags)
 {
     if (!_ready) {
@@ -98,10 +151,11 @@ static size_t onwrite(char* contents, size_t size, size_t nmemb, void* udata)
 {
     size_t realsize = size * nmemb;
     par_easycurl_buffer* mem = (par_easycurl_buffer*) udata;
-    mem->data = (par_byte*) realloc(mem->data, mem->nbytes + realsize + 1);
-    if (!mem->data) {
+    par_byte* data = (par_byte*) realloc(mem->data, mem->nbytes + realsize + 1);
+    if (!data) {
         return 0;
     }
+    mem->data = data;
     memcpy(mem->data + mem->nbytes, contents, realsize);
     mem->nbytes += realsize;
     mem->data[mem->nbytes] = 0;
@@ -135,12 +189,21 @@ bool curlToMemory(char const* url, uint8_t** data, int* nbytes)
 #endif
 
 int par_easycurl_to_memory(char const* url, par_byte** data, int* nbytes)
+{
+    return par_easycurl_to_memory_ex(url, data, nbytes, 0, 0);
+}
+
+int par_easycurl_to_memory_ex(char const* url, par_byte** data, int* nbytes, const char **hdrs, FILE *f)
 {
     char errbuf[CURL_ERROR_SIZE] = {0};
+    if (!f)
+        f = stderr;
     par_easycurl_buffer buffer = {(par_byte*) malloc(1), 0};
-    long code = 0;
-    long status = 0;
     CURL* handle = curl_easy_init();
+    if (!handle) {
+        free(buffer.data);
+        return 0;
+    }
     curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
     curl_easy_setopt(handle, CURLOPT_ENCODING, "gzip, deflate");
     curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
@@ -149,39 +212,54 @@ int par_easycurl_to_memory(char const* url, par_byte** data, int* nbytes)
     curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, onwrite);
     curl_easy_setopt(handle, CURLOPT_WRITEDATA, &buffer);
     curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, onheader);
+    if (_verbose) {
+        curl_easy_setopt(handle, CURLOPT_STDERR, f);
+        curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
+    }
     curl_easy_setopt(handle, CURLOPT_URL, url);
     curl_easy_setopt(handle, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
     curl_easy_setopt(handle, CURLOPT_TIMEVALUE, 0);
-    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, 0);
+    struct curl_slist *hdrs_list = NULL;
+    if (hdrs) {
+        while (*hdrs) {
+            hdrs_list = curl_slist_append(hdrs_list, *hdrs++);
+        }
+    }
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, hdrs_list);
     curl_easy_setopt(handle, CURLOPT_TIMEOUT, 60);
     curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, errbuf);
     curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, 0);
     CURLcode res = curl_easy_perform(handle);
+    long status = par_easycurl_finish(handle);
+    if (hdrs_list)
+        curl_slist_free_all(hdrs_list);
     if (res != CURLE_OK) {
-        fprintf(stderr, "CURL Error: %s\n", errbuf);
+        fprintf(f, "CURL Error: %s\n", errbuf);
+        free(buffer.data);
         return 0;
     }
-    curl_easy_getinfo(handle, CURLINFO_CONDITION_UNMET, &code);
-    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
     if (status == 304 || status >= 400) {
+        free(buffer.data);
         return 0;
     }
     *data = buffer.data;
     *nbytes = buffer.nbytes;
-    curl_easy_cleanup(handle);
     return 1;
 }
 
 int par_easycurl_to_file(char const* srcurl, char const* dstpath)
 {
-    long code = 0;
-    long status = 0;
     FILE* filehandle = fopen(dstpath, "wb");
     if (!filehandle) {
         fprintf(stderr, "Unable to open %s for writing.\n", dstpath);
         return 0;
     }
     CURL* handle = curl_easy_init();
+    if (!handle) {
+        fclose(filehandle);
+        remove(dstpath);
+        return 0;
+    }
     curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
     curl_easy_setopt(handle, CURLOPT_ENCODING, "gzip, deflate");
     curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
@@ -194,22 +272,18 @@ int par_easycurl_to_file(char const* srcurl, char const* dstpath)
     curl_easy_setopt(handle, CURLOPT_TIMEVALUE, 0);
     curl_easy_setopt(handle, CURLOPT_HTTPHEADER, 0);
     curl_easy_setopt(handle, CURLOPT_TIMEOUT, 60);
-    curl_easy_perform(handle);
-    curl_easy_getinfo(handle, CURLINFO_CONDITION_UNMET, &code);
-    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
-    fclose(filehandle);
-    if (status == 304 || status >= 400) {
+    CURLcode res = curl_easy_perform(handle);
+    long status = par_easycurl_finish(handle);
+    if (fclose(filehandle) != 0 || res != CURLE_OK || status == 304 || status >= 400) {
         remove(dstpath);
         return 0;
     }
-    curl_easy_cleanup(handle);
     return 1;
 }
 
 int par_easycurl_to_file_ex(char const* srcurl, char const* dstpath, const char **hdrs, FILE *f)
 {
-    long code = 0;
-    long status = 0;
+    char errbuf[CURL_ERROR_SIZE] = {0};
     if (!f)
         f = stderr;
     FILE* filehandle = fopen(dstpath, "wb");
@@ -218,6 +292,11 @@ int par_easycurl_to_file_ex(char const* srcurl, char const* dstpath, const char
         return 0;
     }
     CURL* handle = curl_easy_init();
+    if (!handle) {
+        fclose(filehandle);
+        remove(dstpath);
+        return 0;
+    }
     curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
     curl_easy_setopt(handle, CURLOPT_ENCODING, "gzip, deflate");
     curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
@@ -240,17 +319,17 @@ int par_easycurl_to_file_ex(char const* srcurl, char const* dstpath, const char
     }
     curl_easy_setopt(handle, CURLOPT_HTTPHEADER, hdrs_list);
     curl_easy_setopt(handle, CURLOPT_TIMEOUT, 60);
-    curl_easy_perform(handle);
-    curl_easy_getinfo(handle, CURLINFO_CONDITION_UNMET, &code);
-    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
-    fclose(filehandle);
-    if (status == 304 || status >= 400) {
+    curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, errbuf);
+    CURLcode res = curl_easy_perform(handle);
+    long status = par_easycurl_finish(handle);
+    if (hdrs_list)
+        curl_slist_free_all(hdrs_list);
+    if (res != CURLE_OK)
+        fprintf(f, "CURL Error: %s\n", errbuf);
+    if (fclose(filehandle) != 0 || res != CURLE_OK || status == 304 || status >= 400) {
         remove(dstpath);
         return 0;
     }
-    curl_easy_cleanup(handle);
-    if (hdrs_list)
-        curl_slist_free_all(hdrs_list);
     return 1;
 }
 